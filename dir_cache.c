@@ -0,0 +1,392 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Persistent cache of directory listings.
+//
+// Loading the icon database requires listing lots of directories and calling
+// stat() on every file in them, for a system with ~40 themes this takes
+// seconds. Most of the time nothing changed since the last run, so we store the
+// listings of all directories we read into a binary file, and the next time
+// the application starts, we memory map this file. A cached listing is used if
+// the modification time of the directory is the same as when it was stored,
+// so a single stat() replaces a readdir() plus a stat() for each entry. Only
+// directories that changed are listed again.
+//
+// The file is written again by dir_cache_save() if anything changed, the
+// layout is the following (all integers are in native byte order):
+//
+//   struct dir_cache_header_t  header;
+//   struct dir_cache_dir_t     dirs[header.num_dirs];     // sorted by path
+//   struct dir_cache_entry_t   entries[header.num_entries];
+//   char                       strings[header.strings_size];
+//
+// All strings are null terminated and referenced by their offset into the
+// strings section.
+//
+// dir_cache_list() can be called concurrently from several threads.
+
+#include <sys/mman.h>
+
+#define DIR_CACHE_MAGIC "ICDC"
+#define DIR_CACHE_VERSION 2
+
+enum dir_entry_type_t {
+    DIR_ENTRY_FILE,
+    DIR_ENTRY_DIR
+};
+
+// NOTE: The size of the header must be a multiple of 8 so the int64_t fields
+// of the directories that follow it are aligned in the mapped file.
+struct dir_cache_header_t {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_dirs;
+    uint32_t num_entries;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+
+struct dir_cache_dir_t {
+    uint32_t path;
+    uint32_t first_entry;
+    uint32_t num_entries;
+    uint32_t reserved;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+struct dir_cache_entry_t {
+    uint32_t name;
+    uint32_t type;
+};
+
+struct dir_listing_t {
+    char *path;
+    struct timespec mtime;
+
+    uint32_t num_entries;
+    struct dir_cache_entry_t *entries;
+    // Base of the name offsets in entries, points into the mapped file for
+    // listings that came from the cache.
+    char *names;
+};
+
+#define dir_listing_name(listing,i) ((listing)->names + (listing)->entries[i].name)
+
+struct dir_cache_t {
+    char *fname;
+
+    // Mapped cache file, NULL if there was no valid one.
+    void *map;
+    size_t map_size;
+    struct dir_cache_header_t *header;
+    struct dir_cache_dir_t *dirs;
+    struct dir_cache_entry_t *entries;
+    char *strings;
+
+    // Listings returned during this run, these are the ones that will be
+    // written by dir_cache_save().
+    GMutex lock;
+    mem_pool_t pool;
+    GHashTable *listings;
+    bool dirty;
+};
+
+void dir_cache_init (struct dir_cache_t *cache, const char *fname)
+{
+    *cache = ZERO_INIT (struct dir_cache_t);
+    g_mutex_init (&cache->lock);
+    cache->fname = pom_strdup (&cache->pool, fname);
+    cache->listings = g_hash_table_new (g_str_hash, g_str_equal);
+
+    int fd = open (fname, O_RDONLY);
+    if (fd == -1) {
+        // NOTE: Not having a cache file is normal on the first run.
+        return;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && st.st_size >= sizeof(struct dir_cache_header_t)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close (fd);
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    struct dir_cache_header_t *header = (struct dir_cache_header_t*)map;
+    size_t expected_size = sizeof(struct dir_cache_header_t) +
+                           (size_t)header->num_dirs*sizeof(struct dir_cache_dir_t) +
+                           (size_t)header->num_entries*sizeof(struct dir_cache_entry_t) +
+                           header->strings_size;
+
+    if (memcmp (header->magic, DIR_CACHE_MAGIC, 4) != 0 ||
+        header->version != DIR_CACHE_VERSION ||
+        expected_size != st.st_size ||
+        header->strings_size == 0 ||
+        ((char*)map)[st.st_size-1] != '\0') {
+        printf ("Ignoring invalid directory cache: %s\n", fname);
+        munmap (map, st.st_size);
+        return;
+    }
+
+    cache->map = map;
+    cache->map_size = st.st_size;
+    cache->header = header;
+    cache->dirs = (struct dir_cache_dir_t*)(header + 1);
+    cache->entries = (struct dir_cache_entry_t*)(cache->dirs + header->num_dirs);
+    cache->strings = (char*)(cache->entries + header->num_entries);
+}
+
+void dir_cache_destroy (struct dir_cache_t *cache)
+{
+    if (cache->map != NULL) {
+        munmap (cache->map, cache->map_size);
+    }
+    g_hash_table_destroy (cache->listings);
+    g_mutex_clear (&cache->lock);
+    mem_pool_destroy (&cache->pool);
+}
+
+// Binary search for path in the mapped file. Returns NULL if the directory is
+// not there, or if its record is corrupt.
+struct dir_cache_dir_t* dir_cache_lookup_mapped (struct dir_cache_t *cache, const char *path)
+{
+    if (cache->map == NULL) {
+        return NULL;
+    }
+
+    int lo = 0;
+    int hi = cache->header->num_dirs - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo)/2;
+        struct dir_cache_dir_t *dir = &cache->dirs[mid];
+        if (dir->path >= cache->header->strings_size) {
+            return NULL;
+        }
+
+        int cmp = strcmp (path, cache->strings + dir->path);
+        if (cmp == 0) {
+            if ((uint64_t)dir->first_entry + dir->num_entries > cache->header->num_entries) {
+                return NULL;
+            }
+
+            for (int i=0; i<dir->num_entries; i++) {
+                if (cache->entries[dir->first_entry + i].name >= cache->header->strings_size) {
+                    return NULL;
+                }
+            }
+            return dir;
+
+        } else if (cmp < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Read the directory at path from the file system. Entries are accumulated in
+// entries_buff and names_buff.
+bool dir_cache_read_dir (const char *path, cont_buff_t *entries_buff, cont_buff_t *names_buff)
+{
+    DIR *d = opendir (path);
+    if (d == NULL) {
+        return false;
+    }
+
+    string_t path_str = str_new (path);
+    if (str_last(&path_str) != '/') {
+        str_cat_c (&path_str, "/");
+    }
+    uint32_t path_len = str_len (&path_str);
+
+    struct dirent *entry_info;
+    while (read_dir (d, &entry_info)) {
+        if (strcmp (entry_info->d_name, ".") == 0 || strcmp (entry_info->d_name, "..") == 0) {
+            continue;
+        }
+
+        struct stat st;
+        str_put_c (&path_str, path_len, entry_info->d_name);
+        if (stat (str_data(&path_str), &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            uint32_t name_size = strlen(entry_info->d_name) + 1;
+
+            struct dir_cache_entry_t *entry = cont_buff_push (entries_buff, sizeof(struct dir_cache_entry_t));
+            entry->name = names_buff->used;
+            entry->type = S_ISDIR(st.st_mode) ? DIR_ENTRY_DIR : DIR_ENTRY_FILE;
+
+            char *name = cont_buff_push (names_buff, name_size);
+            memcpy (name, entry_info->d_name, name_size);
+        }
+    }
+    closedir (d);
+
+    str_free (&path_str);
+    return true;
+}
+
+// Get the listing of the directory at path, either from the cache or from the
+// file system if the directory changed since the cache was written. Returns
+// false if the directory does not exist.
+//
+// The returned listing stays valid until dir_cache_destroy() is called.
+bool dir_cache_list (struct dir_cache_t *cache, const char *path, struct dir_listing_t *listing)
+{
+    g_mutex_lock (&cache->lock);
+    struct dir_listing_t *res = g_hash_table_lookup (cache->listings, path);
+    g_mutex_unlock (&cache->lock);
+
+    if (res != NULL) {
+        *listing = *res;
+        return true;
+    }
+
+    struct stat st;
+    if (stat (path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+
+    struct dir_listing_t new_listing = ZERO_INIT (struct dir_listing_t);
+    new_listing.mtime = st.st_mtim;
+
+    bool is_fresh = false;
+    cont_buff_t entries_buff = {0};
+    cont_buff_t names_buff = {0};
+
+    struct dir_cache_dir_t *dir = dir_cache_lookup_mapped (cache, path);
+    if (dir != NULL && dir->mtime_sec == st.st_mtim.tv_sec && dir->mtime_nsec == st.st_mtim.tv_nsec) {
+        new_listing.num_entries = dir->num_entries;
+        new_listing.entries = &cache->entries[dir->first_entry];
+        new_listing.names = cache->strings;
+
+    } else {
+        is_fresh = true;
+        if (!dir_cache_read_dir (path, &entries_buff, &names_buff)) {
+            return false;
+        }
+    }
+
+    g_mutex_lock (&cache->lock);
+    res = g_hash_table_lookup (cache->listings, path);
+    if (res == NULL) {
+        if (is_fresh) {
+            new_listing.num_entries = entries_buff.used/sizeof(struct dir_cache_entry_t);
+            new_listing.entries = pom_dup (&cache->pool, entries_buff.data, entries_buff.used);
+            new_listing.names = pom_dup (&cache->pool, names_buff.data, names_buff.used);
+            cache->dirty = true;
+        }
+        new_listing.path = pom_strdup (&cache->pool, path);
+
+        res = pom_dup (&cache->pool, &new_listing, sizeof(struct dir_listing_t));
+        g_hash_table_insert (cache->listings, res->path, res);
+    }
+    g_mutex_unlock (&cache->lock);
+
+    cont_buff_destroy (&entries_buff);
+    cont_buff_destroy (&names_buff);
+
+    *listing = *res;
+    return true;
+}
+
+int dir_listing_path_cmp (const void *a, const void *b)
+{
+    return strcmp ((*(struct dir_listing_t**)a)->path, (*(struct dir_listing_t**)b)->path);
+}
+
+// Write all listings returned during this run into the cache file. Directories
+// that were not listed are dropped from the cache. Nothing is written if all
+// listings came from the cache.
+void dir_cache_save (struct dir_cache_t *cache)
+{
+    g_mutex_lock (&cache->lock);
+
+    uint32_t num_dirs = g_hash_table_size (cache->listings);
+    if (!cache->dirty && cache->map != NULL && cache->header->num_dirs == num_dirs) {
+        g_mutex_unlock (&cache->lock);
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    struct dir_listing_t **listings = mem_pool_push_array (&pool, num_dirs, struct dir_listing_t*);
+    {
+        GHashTableIter iter;
+        gpointer value;
+        int i = 0;
+        g_hash_table_iter_init (&iter, cache->listings);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            listings[i++] = value;
+        }
+    }
+    qsort (listings, num_dirs, sizeof(struct dir_listing_t*), dir_listing_path_cmp);
+
+    uint32_t num_entries = 0;
+    uint32_t strings_size = 0;
+    for (int i=0; i<num_dirs; i++) {
+        num_entries += listings[i]->num_entries;
+        strings_size += strlen (listings[i]->path) + 1;
+        for (int j=0; j<listings[i]->num_entries; j++) {
+            strings_size += strlen (dir_listing_name (listings[i], j)) + 1;
+        }
+    }
+
+    size_t file_size = sizeof(struct dir_cache_header_t) +
+                       (size_t)num_dirs*sizeof(struct dir_cache_dir_t) +
+                       (size_t)num_entries*sizeof(struct dir_cache_entry_t) +
+                       strings_size;
+    uint8_t *data = pom_push_size (NULL, file_size);
+
+    struct dir_cache_header_t *header = (struct dir_cache_header_t*)data;
+    memcpy (header->magic, DIR_CACHE_MAGIC, 4);
+    header->version = DIR_CACHE_VERSION;
+    header->num_dirs = num_dirs;
+    header->num_entries = num_entries;
+    header->strings_size = strings_size;
+    header->reserved = 0;
+
+    struct dir_cache_dir_t *dirs = (struct dir_cache_dir_t*)(header + 1);
+    struct dir_cache_entry_t *entries = (struct dir_cache_entry_t*)(dirs + num_dirs);
+    char *strings = (char*)(entries + num_entries);
+
+    uint32_t entry_idx = 0;
+    char *s = strings;
+    for (int i=0; i<num_dirs; i++) {
+        struct dir_listing_t *listing = listings[i];
+        dirs[i] = ZERO_INIT (struct dir_cache_dir_t);
+        dirs[i].path = s - strings;
+        dirs[i].first_entry = entry_idx;
+        dirs[i].num_entries = listing->num_entries;
+        dirs[i].mtime_sec = listing->mtime.tv_sec;
+        dirs[i].mtime_nsec = listing->mtime.tv_nsec;
+        s = stpcpy (s, listing->path) + 1;
+
+        for (int j=0; j<listing->num_entries; j++) {
+            entries[entry_idx].name = s - strings;
+            entries[entry_idx].type = listing->entries[j].type;
+            s = stpcpy (s, dir_listing_name (listing, j)) + 1;
+            entry_idx++;
+        }
+    }
+
+    g_mutex_unlock (&cache->lock);
+
+    // Write into a temporary file and then rename it, so a running instance
+    // that has the old file mapped, or a crash while writing, never sees a
+    // partially written cache.
+    char *tmp_fname = pprintf (&pool, "%s.tmp", cache->fname);
+    if (ensure_path_exists (cache->fname) && !full_file_write (data, file_size, tmp_fname)) {
+        if (rename (tmp_fname, cache->fname) != 0) {
+            printf ("Error writing directory cache %s: %s\n", cache->fname, strerror(errno));
+            unlink (tmp_fname);
+        }
+    }
+
+    free (data);
+    mem_pool_destroy (&pool);
+}
@@ -0,0 +1,281 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Reader for the icon-theme.cache files created by gtk-update-icon-cache.
+//
+// Most installed themes ship one of these at the root of the theme directory.
+// It lists the name of every icon in every subdirectory of the theme, so if
+// it's up to date, we can use it instead of listing all directories of the
+// theme. The file is memory mapped and never copied. The format is the one
+// read by GTK in gtk/gtkiconcache.c, all integers are big endian:
+//
+//   Header:
+//     u16 major_version (1)
+//     u16 minor_version (0)
+//     u32 hash_offset
+//     u32 directory_list_offset
+//
+//   DirectoryList:
+//     u32 n_directories
+//     u32 directory_offset[n_directories]   // null terminated relative paths
+//
+//   Hash:
+//     u32 n_buckets
+//     u32 icon_offset[n_buckets]            // 0xFFFFFFFF if the bucket is empty
+//
+//   Icon:
+//     u32 chain_offset                      // next icon in bucket or 0xFFFFFFFF
+//     u32 name_offset
+//     u32 image_list_offset
+//
+//   ImageList:
+//     u32 n_images
+//     Image images[n_images]
+//
+//   Image:
+//     u16 directory_index
+//     u16 flags
+//     u32 image_data_offset
+//
+// Icon names are stored without their last extension, which is represented by
+// the flags instead. This means "foo.symbolic.png" is stored as "foo.symbolic"
+// with the GTK_ICON_CACHE_HAS_SUFFIX_PNG flag.
+//
+// Every read is bounds checked, a corrupt cache file won't crash us, it will
+// just look like it has less icons. Chains are followed at most for as many
+// icons as fit in the file, and image lists are clamped to the images that fit
+// after them, so a corrupt file with a cycle or a huge n_images can't hang us
+// either. Offsets are added in size_t so they can't wrap around before being
+// checked.
+
+#define GTK_ICON_CACHE_FNAME "icon-theme.cache"
+#define GTK_ICON_CACHE_MAJOR_VERSION 1
+
+#define GTK_ICON_CACHE_NONE 0xFFFFFFFF
+
+// Size of an Icon entry, used to bound the number of icons in a file.
+#define GTK_ICON_CACHE_ICON_SIZE 12
+
+#define GTK_ICON_CACHE_HAS_SUFFIX_XPM (1 << 0)
+#define GTK_ICON_CACHE_HAS_SUFFIX_SVG (1 << 1)
+#define GTK_ICON_CACHE_HAS_SUFFIX_PNG (1 << 2)
+
+struct gtk_icon_cache_t {
+    uint8_t *data;
+    size_t size;
+
+    uint32_t hash_offset;
+    uint32_t n_buckets;
+    uint32_t dir_list_offset;
+    uint32_t n_dirs;
+};
+
+struct {
+    uint16_t flag;
+    const char *suffix;
+} gtk_icon_cache_suffixes[] = {
+    {GTK_ICON_CACHE_HAS_SUFFIX_SVG, ".svg"},
+    {GTK_ICON_CACHE_HAS_SUFFIX_PNG, ".png"},
+    {GTK_ICON_CACHE_HAS_SUFFIX_XPM, ".xpm"}
+};
+
+static inline
+bool gtk_icon_cache_u16 (struct gtk_icon_cache_t *cache, size_t offset, uint16_t *res)
+{
+    if (offset + 2 > cache->size) {
+        return false;
+    }
+
+    uint8_t *p = cache->data + offset;
+    *res = (uint16_t)p[0] << 8 | p[1];
+    return true;
+}
+
+static inline
+bool gtk_icon_cache_u32 (struct gtk_icon_cache_t *cache, size_t offset, uint32_t *res)
+{
+    if (offset + 4 > cache->size) {
+        return false;
+    }
+
+    uint8_t *p = cache->data + offset;
+    *res = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    return true;
+}
+
+// Returns NULL if offset doesn't point to a null terminated string inside the
+// file.
+static inline
+char* gtk_icon_cache_str (struct gtk_icon_cache_t *cache, uint32_t offset)
+{
+    if (offset >= cache->size || memchr (cache->data + offset, '\0', cache->size - offset) == NULL) {
+        return NULL;
+    }
+    return (char*)cache->data + offset;
+}
+
+// Maps the cache file of the theme directory theme_dir. Returns false, and
+// leaves cache zero initialized if there is no cache, or if it is older than
+// the theme directory (which is what GTK considers an invalid cache).
+bool gtk_icon_cache_open (struct gtk_icon_cache_t *cache, const char *theme_dir)
+{
+    *cache = ZERO_INIT (struct gtk_icon_cache_t);
+
+    string_t path = str_new (theme_dir);
+    if (str_last (&path) != '/') {
+        str_cat_c (&path, "/");
+    }
+    str_cat_c (&path, GTK_ICON_CACHE_FNAME);
+
+    bool success = false;
+    struct stat dir_st, cache_st;
+    int fd = open (str_data(&path), O_RDONLY);
+    if (fd != -1) {
+        if (stat (theme_dir, &dir_st) == 0 && fstat (fd, &cache_st) == 0 &&
+            cache_st.st_mtime >= dir_st.st_mtime && cache_st.st_size >= 12) {
+            void *map = mmap (NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                cache->data = map;
+                cache->size = cache_st.st_size;
+                success = true;
+            }
+        }
+        close (fd);
+    }
+    str_free (&path);
+
+    if (success) {
+        uint16_t major;
+        success = gtk_icon_cache_u16 (cache, 0, &major) &&
+                  major == GTK_ICON_CACHE_MAJOR_VERSION &&
+                  gtk_icon_cache_u32 (cache, 4, &cache->hash_offset) &&
+                  gtk_icon_cache_u32 (cache, 8, &cache->dir_list_offset) &&
+                  gtk_icon_cache_u32 (cache, cache->hash_offset, &cache->n_buckets) &&
+                  gtk_icon_cache_u32 (cache, cache->dir_list_offset, &cache->n_dirs);
+
+        if (!success) {
+            munmap (cache->data, cache->size);
+            *cache = ZERO_INIT (struct gtk_icon_cache_t);
+        }
+    }
+
+    return success;
+}
+
+void gtk_icon_cache_close (struct gtk_icon_cache_t *cache)
+{
+    if (cache->data != NULL) {
+        munmap (cache->data, cache->size);
+    }
+    *cache = ZERO_INIT (struct gtk_icon_cache_t);
+}
+
+static inline
+bool gtk_icon_cache_is_valid (struct gtk_icon_cache_t *cache)
+{
+    return cache != NULL && cache->data != NULL;
+}
+
+// Returns the index of the directory dir_name (relative to the theme
+// directory) or -1 if the cache doesn't know about it. A trailing '/' in
+// dir_name is ignored.
+int gtk_icon_cache_dir_idx (struct gtk_icon_cache_t *cache, const char *dir_name, uint32_t dir_name_len)
+{
+    if (dir_name_len > 0 && dir_name[dir_name_len-1] == '/') {
+        dir_name_len--;
+    }
+
+    for (uint32_t i=0; i<cache->n_dirs; i++) {
+        uint32_t offset;
+        char *curr_dir;
+        if (gtk_icon_cache_u32 (cache, (size_t)cache->dir_list_offset + 4 + 4*(size_t)i, &offset) &&
+            (curr_dir = gtk_icon_cache_str (cache, offset)) != NULL &&
+            strncmp (curr_dir, dir_name, dir_name_len) == 0 &&
+            curr_dir[dir_name_len] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Iterator over all icons in the cache. Usage:
+//
+//   struct gtk_icon_cache_iter_t it = {0};
+//   while (gtk_icon_cache_next_icon (cache, &it)) {
+//       for (int i=0; i<it.n_images; i++) {
+//           uint16_t dir_idx, flags;
+//           gtk_icon_cache_icon_image (cache, &it, i, &dir_idx, &flags);
+//           ...
+//       }
+//   }
+struct gtk_icon_cache_iter_t {
+    uint32_t bucket;
+    uint32_t icon_offset;
+    size_t num_icons;
+
+    char *name;
+    uint32_t image_list_offset;
+    uint32_t n_images;
+};
+
+bool gtk_icon_cache_read_icon (struct gtk_icon_cache_t *cache, struct gtk_icon_cache_iter_t *it)
+{
+    if (++it->num_icons > cache->size/GTK_ICON_CACHE_ICON_SIZE) {
+        // There are more icons than what fits in the file, chains are cyclic.
+        return false;
+    }
+
+    uint32_t name_offset;
+    if (!gtk_icon_cache_u32 (cache, (size_t)it->icon_offset + 4, &name_offset) ||
+        (it->name = gtk_icon_cache_str (cache, name_offset)) == NULL ||
+        !gtk_icon_cache_u32 (cache, (size_t)it->icon_offset + 8, &it->image_list_offset) ||
+        !gtk_icon_cache_u32 (cache, it->image_list_offset, &it->n_images)) {
+        return false;
+    }
+
+    // Don't trust n_images, clamp it to the number of images that fit between
+    // the image list and the end of the file. Reading the u32 above already
+    // guarantees image_list_offset + 4 <= cache->size.
+    size_t max_images = (cache->size - (size_t)it->image_list_offset - 4)/8;
+    if (it->n_images > max_images) {
+        it->n_images = max_images;
+    }
+    return true;
+}
+
+bool gtk_icon_cache_next_icon (struct gtk_icon_cache_t *cache, struct gtk_icon_cache_iter_t *it)
+{
+    // Follow the chain of the current bucket. A zero icon_offset means we
+    // haven't started yet.
+    if (it->icon_offset != 0) {
+        if (!gtk_icon_cache_u32 (cache, it->icon_offset, &it->icon_offset)) {
+            return false;
+        }
+
+        if (it->icon_offset != GTK_ICON_CACHE_NONE) {
+            return gtk_icon_cache_read_icon (cache, it);
+        }
+        it->bucket++;
+    }
+
+    for (; it->bucket < cache->n_buckets; it->bucket++) {
+        if (!gtk_icon_cache_u32 (cache, (size_t)cache->hash_offset + 4 + 4*(size_t)it->bucket, &it->icon_offset)) {
+            return false;
+        }
+
+        if (it->icon_offset != GTK_ICON_CACHE_NONE) {
+            return gtk_icon_cache_read_icon (cache, it);
+        }
+    }
+
+    return false;
+}
+
+bool gtk_icon_cache_icon_image (struct gtk_icon_cache_t *cache, struct gtk_icon_cache_iter_t *it,
+                                uint32_t idx, uint16_t *dir_idx, uint16_t *flags)
+{
+    size_t image_offset = (size_t)it->image_list_offset + 4 + 8*(size_t)idx;
+    return gtk_icon_cache_u16 (cache, image_offset, dir_idx) &&
+           gtk_icon_cache_u16 (cache, image_offset + 2, flags);
+}
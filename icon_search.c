@@ -0,0 +1,1698 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Incremental substring search over the rows of an icon name list.
+//
+// While typing, each new query usually extends the previous one. Any name that
+// contains the new query also contains all its prefixes, so we only need to
+// look at the names that matched the previous query. To make this work when
+// deleting characters too, we keep a stack with the results of previous
+// queries, each one a prefix of the next. A new query pops all levels that
+// aren't a prefix of it, then filters the matches of the top level (or all
+// rows if the stack is empty) and pushes the result.
+//
+// Matches are stored as sorted indices into fk_list_box->rows, so the search
+// state must be recreated with icon_search_prepare() every time the rows of
+// the list are recreated.
+//
+// icon_search_prepare() copies the names of all rows into a single buffer
+// (struct packed_names_t), scans that don't have a smaller set of candidates
+// are done there with a SIMD matcher. For big lists it can also create a
+// trigram index of the rows, then queries of 3 or more characters only look
+// at rows that contain all trigrams of the query, which usually is a tiny
+// fraction of them.
+//
+// While the user types, searches are started with icon_search_start(). They
+// are debounced and run in a worker thread, each new query cancels the
+// previous one, and the list is updated from the main loop when a search
+// finishes. icon_search_apply() and icon_search_apply_fuzzy() do the same
+// synchronously, they are used when the list itself changes.
+//
+// Besides exact substring matching there is a fuzzy mode, here rows don't
+// need to contain the query, only its characters in the same order. Matching
+// rows are scored and shown sorted by score.
+//
+// Results can also be restricted to a set of rows computed elsewhere with
+// icon_search_set_filter(). The filter is applied when results are shown, so
+// cached levels stay valid when it changes.
+//
+// Queries from the search entry go through icon_search_query(), they can be
+// boolean combinations of several terms, see the comment above it.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ICON_SEARCH_SIMD
+#include <immintrin.h>
+#endif
+
+#define ICON_SEARCH_MAX_LEVELS 32
+
+// Names stored one after the other, separated by '\0', name i starts at
+// data[offsets[i]]. The buffer is followed by PACKED_NAMES_PADDING zero bytes
+// so SIMD loads close to the end don't read outside of it.
+#define PACKED_NAMES_PADDING 64
+
+struct packed_names_t {
+    char *data;
+    size_t len;
+    uint32_t num_names;
+    uint32_t *offsets; // num_names+1 elements
+};
+
+void packed_names_build (struct packed_names_t *packed, char **names, uint32_t num_names)
+{
+    *packed = ZERO_INIT (struct packed_names_t);
+    packed->num_names = num_names;
+    packed->offsets = malloc ((num_names + 1)*sizeof(uint32_t));
+
+    size_t len = 0;
+    for (uint32_t i=0; i<num_names; i++) {
+        packed->offsets[i] = len;
+        len += strlen (names[i]) + 1;
+    }
+    packed->offsets[num_names] = len;
+    assert (len <= UINT32_MAX);
+
+    packed->len = len;
+    packed->data = malloc (len + PACKED_NAMES_PADDING);
+    for (uint32_t i=0; i<num_names; i++) {
+        memcpy (packed->data + packed->offsets[i], names[i],
+                packed->offsets[i+1] - packed->offsets[i]);
+    }
+    memset (packed->data + len, 0, PACKED_NAMES_PADDING);
+}
+
+void packed_names_destroy (struct packed_names_t *packed)
+{
+    free (packed->data);
+    free (packed->offsets);
+    *packed = ZERO_INIT (struct packed_names_t);
+}
+
+static inline
+char* packed_names_get (struct packed_names_t *packed, uint32_t idx)
+{
+    return packed->data + packed->offsets[idx];
+}
+
+// Advance row until it's the name that contains the byte at pos.
+static inline
+uint32_t packed_names_row_at (struct packed_names_t *packed, uint32_t row, size_t pos)
+{
+    while (packed->offsets[row+1] <= pos) {
+        row++;
+    }
+    return row;
+}
+
+// All matchers write the indices of the names that contain query (of length
+// query_len > 0) into matches, in increasing order, and return how many there
+// are. matches must have space for all names.
+#define PACKED_NAMES_MATCH_FUNC(name) \
+    uint32_t name (struct packed_names_t *packed, const char *query, size_t query_len, uint32_t *matches)
+typedef PACKED_NAMES_MATCH_FUNC(packed_names_match_func_t);
+
+// Scalar matcher for names starting at first_row, it's also used by the SIMD
+// matchers to handle the end of the buffer.
+uint32_t packed_names_match_scalar_from (struct packed_names_t *packed, const char *query,
+                                         uint32_t first_row, uint32_t *matches)
+{
+    uint32_t num_matches = 0;
+    for (uint32_t i=first_row; i<packed->num_names; i++) {
+        if (strstr (packed_names_get (packed, i), query) != NULL) {
+            matches[num_matches++] = i;
+        }
+    }
+    return num_matches;
+}
+
+PACKED_NAMES_MATCH_FUNC(packed_names_match_scalar)
+{
+    return packed_names_match_scalar_from (packed, query, 0, matches);
+}
+
+#ifdef ICON_SEARCH_SIMD
+// The SIMD matchers compare blocks of the buffer against the first and last
+// bytes of the query at the same time, and only positions where both match
+// are compared with memcmp(). Because the query never contains '\0', a match
+// can't span two names. After a name matches we skip to the next one.
+//
+// Each block loads bytes up to i + query_len - 1 + WIDTH, when that doesn't
+// fit in the padding the rest of the names are checked with the scalar
+// matcher.
+__attribute__((target("sse2")))
+PACKED_NAMES_MATCH_FUNC(packed_names_match_sse2)
+{
+    uint32_t num_matches = 0;
+    uint32_t row = 0;
+    const char *data = packed->data;
+    __m128i first = _mm_set1_epi8 (query[0]);
+    __m128i last = _mm_set1_epi8 (query[query_len-1]);
+
+    size_t i = 0;
+    while (i + query_len <= packed->len &&
+           i + query_len - 1 + 16 <= packed->len + PACKED_NAMES_PADDING) {
+        __m128i block_first = _mm_loadu_si128 ((const __m128i*)(data + i));
+        __m128i block_last = _mm_loadu_si128 ((const __m128i*)(data + i + query_len - 1));
+        uint32_t mask = _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (first, block_first),
+                                                          _mm_cmpeq_epi8 (last, block_last)));
+
+        size_t next_i = i + 16;
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz (mask);
+            if (query_len <= 2 || memcmp (data + pos + 1, query + 1, query_len - 2) == 0) {
+                row = packed_names_row_at (packed, row, pos);
+                matches[num_matches++] = row;
+                next_i = packed->offsets[row+1];
+                break;
+            }
+            mask &= mask - 1;
+        }
+        i = next_i;
+    }
+
+    if (i < packed->len) {
+        row = packed_names_row_at (packed, row, i);
+        num_matches += packed_names_match_scalar_from (packed, query, row, matches + num_matches);
+    }
+    return num_matches;
+}
+
+__attribute__((target("avx2")))
+PACKED_NAMES_MATCH_FUNC(packed_names_match_avx2)
+{
+    uint32_t num_matches = 0;
+    uint32_t row = 0;
+    const char *data = packed->data;
+    __m256i first = _mm256_set1_epi8 (query[0]);
+    __m256i last = _mm256_set1_epi8 (query[query_len-1]);
+
+    size_t i = 0;
+    while (i + query_len <= packed->len &&
+           i + query_len - 1 + 32 <= packed->len + PACKED_NAMES_PADDING) {
+        __m256i block_first = _mm256_loadu_si256 ((const __m256i*)(data + i));
+        __m256i block_last = _mm256_loadu_si256 ((const __m256i*)(data + i + query_len - 1));
+        uint32_t mask = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_cmpeq_epi8 (first, block_first),
+                                                                _mm256_cmpeq_epi8 (last, block_last)));
+
+        size_t next_i = i + 32;
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz (mask);
+            if (query_len <= 2 || memcmp (data + pos + 1, query + 1, query_len - 2) == 0) {
+                row = packed_names_row_at (packed, row, pos);
+                matches[num_matches++] = row;
+                next_i = packed->offsets[row+1];
+                break;
+            }
+            mask &= mask - 1;
+        }
+        i = next_i;
+    }
+
+    if (i < packed->len) {
+        row = packed_names_row_at (packed, row, i);
+        num_matches += packed_names_match_scalar_from (packed, query, row, matches + num_matches);
+    }
+    return num_matches;
+}
+#endif
+
+// Returns the fastest matcher supported by the CPU we are running on.
+packed_names_match_func_t* packed_names_get_matcher ()
+{
+    static packed_names_match_func_t *matcher = NULL;
+    if (matcher == NULL) {
+        matcher = packed_names_match_scalar;
+#ifdef ICON_SEARCH_SIMD
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2")) {
+            matcher = packed_names_match_avx2;
+        } else if (__builtin_cpu_supports ("sse2")) {
+            matcher = packed_names_match_sse2;
+        }
+#endif
+    }
+    return matcher;
+}
+
+// Trigrams are hashed into a fixed number of buckets, rows in a bucket may
+// not contain the trigram we are looking for, so candidates must always be
+// checked with strstr(). Posting lists are stored in a single array (CSR
+// layout), the ones of bucket b are postings[offsets[b]] to
+// postings[offsets[b+1]-1], they are sorted row indices.
+#define TRIGRAM_INDEX_BUCKETS (1<<16)
+
+struct trigram_index_t {
+    uint32_t *offsets;
+    uint32_t *postings;
+};
+
+static inline
+uint32_t trigram_bucket (const char *s)
+{
+    const uint8_t *p = (const uint8_t*)s;
+    uint32_t trigram = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (trigram*2654435761u) >> (32 - 16);
+}
+
+void trigram_index_destroy (struct trigram_index_t *index)
+{
+    free (index->offsets);
+    free (index->postings);
+    *index = ZERO_INIT (struct trigram_index_t);
+}
+
+void trigram_index_build (struct trigram_index_t *index, struct fk_list_box_t *fk_list_box)
+{
+    *index = ZERO_INIT (struct trigram_index_t);
+    index->offsets = calloc (TRIGRAM_INDEX_BUCKETS + 1, sizeof(uint32_t));
+
+    // Last row added to each bucket plus 1, so each row is added only once
+    // to each bucket even if it has repeated trigrams.
+    uint32_t *last_row = calloc (TRIGRAM_INDEX_BUCKETS, sizeof(uint32_t));
+
+    // Count postings of each bucket into offsets[b+1]
+    for (int i=0; i<fk_list_box->num_rows; i++) {
+        const char *name = fk_list_box->rows[i].data;
+        size_t len = strlen (name);
+        for (size_t j=0; j+3<=len; j++) {
+            uint32_t b = trigram_bucket (name + j);
+            if (last_row[b] != i+1) {
+                last_row[b] = i+1;
+                index->offsets[b+1]++;
+            }
+        }
+    }
+
+    for (int b=0; b<TRIGRAM_INDEX_BUCKETS; b++) {
+        index->offsets[b+1] += index->offsets[b];
+    }
+
+    // Fill postings, rows are iterated in order so lists end up sorted.
+    index->postings = malloc (MAX(index->offsets[TRIGRAM_INDEX_BUCKETS], 1)*sizeof(uint32_t));
+    uint32_t *next = malloc (TRIGRAM_INDEX_BUCKETS*sizeof(uint32_t));
+    memcpy (next, index->offsets, TRIGRAM_INDEX_BUCKETS*sizeof(uint32_t));
+    memset (last_row, 0, TRIGRAM_INDEX_BUCKETS*sizeof(uint32_t));
+    for (int i=0; i<fk_list_box->num_rows; i++) {
+        const char *name = fk_list_box->rows[i].data;
+        size_t len = strlen (name);
+        for (size_t j=0; j+3<=len; j++) {
+            uint32_t b = trigram_bucket (name + j);
+            if (last_row[b] != i+1) {
+                last_row[b] = i+1;
+                index->postings[next[b]++] = i;
+            }
+        }
+    }
+
+    free (next);
+    free (last_row);
+}
+
+// Computes the rows that have all trigrams of query (len >= 3), they are
+// returned in a newly allocated array in candidates. If the shortest posting
+// list for a trigram of query has max_candidates rows or more, then the index
+// won't help and false is returned without computing anything.
+bool trigram_index_candidates (struct trigram_index_t *index, const char *query, size_t len,
+                               uint32_t max_candidates,
+                               uint32_t **candidates, uint32_t *num_candidates)
+{
+    assert (len >= 3);
+
+    uint32_t num_buckets = len - 2;
+    uint32_t buckets[num_buckets];
+    uint32_t smallest_bucket = 0;
+    uint32_t n = UINT32_MAX;
+    for (uint32_t i=0; i<num_buckets; i++) {
+        buckets[i] = trigram_bucket (query + i);
+        uint32_t posting_len = index->offsets[buckets[i]+1] - index->offsets[buckets[i]];
+        if (posting_len < n) {
+            smallest_bucket = buckets[i];
+            n = posting_len;
+        }
+    }
+
+    if (n >= max_candidates) {
+        return false;
+    }
+
+    uint32_t *res = malloc (MAX(n, 1)*sizeof(uint32_t));
+    memcpy (res, index->postings + index->offsets[smallest_bucket], n*sizeof(uint32_t));
+
+    // Intersect with the posting lists of all other trigrams.
+    for (uint32_t i=0; i<num_buckets && n > 0; i++) {
+        if (buckets[i] == smallest_bucket) continue;
+
+        uint32_t *posting = index->postings + index->offsets[buckets[i]];
+        uint32_t *posting_end = index->postings + index->offsets[buckets[i]+1];
+
+        uint32_t new_n = 0;
+        for (uint32_t j=0; j<n && posting < posting_end; j++) {
+            while (posting < posting_end && *posting < res[j]) {
+                posting++;
+            }
+
+            if (posting < posting_end && *posting == res[j]) {
+                res[new_n++] = res[j];
+            }
+        }
+        n = new_n;
+    }
+
+    *candidates = res;
+    *num_candidates = n;
+    return true;
+}
+
+struct icon_search_level_t {
+    char *query;
+    uint32_t num_matches;
+    uint32_t *matches;
+};
+
+#define ICON_SEARCH_MAX_TERMS 64
+
+// Rows that match a term of a boolean query, as a bitset over the rows.
+struct icon_search_term_t {
+    char *text;
+    bool is_keyed;
+    uint32_t count;
+    uint64_t *bits;
+};
+
+// If defined, the query-to-paint latency of searches started with
+// icon_search_start() is printed to stdout. Useful when working on search
+// performance.
+//#define ICON_SEARCH_LATENCY_PROBE
+
+// Time to wait after the last keystroke before starting a search.
+#define ICON_SEARCH_DEBOUNCE_MS 40
+
+enum icon_search_mode_t {
+    ICON_SEARCH_EXACT,
+    ICON_SEARCH_FUZZY
+};
+
+struct icon_search_t {
+    int num_levels;
+    struct icon_search_level_t levels[ICON_SEARCH_MAX_LEVELS];
+
+    bool has_index;
+    struct trigram_index_t index;
+
+    bool has_packed_names;
+    struct packed_names_t packed_names;
+
+    // Bitset over the rows, only rows set here are shown. NULL if all rows
+    // can be shown.
+    uint64_t *filter;
+
+    // Cache of the terms of boolean queries. When it's full, the oldest term
+    // is replaced.
+    int num_terms;
+    int next_term;
+    struct icon_search_term_t terms[ICON_SEARCH_MAX_TERMS];
+
+    // Jobs started by icon_search_start() run here one at a time. job is the
+    // last one started, NULL if it finished or was cancelled. While
+    // debounce_source is not 0, job is waiting for the debounce timeout and
+    // hasn't been pushed to the pool yet.
+    GThreadPool *pool;
+    struct icon_search_job_t *job;
+    guint debounce_source;
+
+#ifdef ICON_SEARCH_LATENCY_PROBE
+    GtkWidget *probe_widget;
+    bool probe_pending;
+    struct timespec probe_start;
+#endif
+};
+
+struct icon_search_job_t {
+    struct icon_search_t *search;
+    struct fk_list_box_t *fk_list_box;
+    enum icon_search_mode_t mode;
+    char *query;
+
+    // Set from the main thread, the worker checks it every
+    // ICON_SEARCH_CANCEL_CHECK names.
+    gint cancelled;
+
+    // For exact searches, the matches of the level the search starts from. It's
+    // a copy because the level may be popped while the job runs. If it's NULL
+    // all rows are candidates. If query_cached is true, the level is the
+    // result of query already.
+    uint32_t num_candidates;
+    uint32_t *candidates;
+    bool query_cached;
+
+    // Boolean part of the query, NULL if the filter of the search doesn't
+    // change. See struct icon_search_job_program_t.
+    struct icon_search_job_program_t *program;
+
+    // Result, indices of rows in the order they should be shown.
+    uint32_t num_rows;
+    uint32_t *rows;
+};
+
+void icon_search_job_program_destroy (struct icon_search_job_program_t *job_program);
+
+void icon_search_job_destroy (struct icon_search_job_t *job)
+{
+    if (job->program != NULL) {
+        icon_search_job_program_destroy (job->program);
+    }
+    free (job->query);
+    free (job->candidates);
+    free (job->rows);
+    free (job);
+}
+
+// Cancel the current job if any. Jobs that already started are freed when
+// they finish, see icon_search_job_done().
+void icon_search_cancel (struct icon_search_t *search)
+{
+    if (search->debounce_source != 0) {
+        g_source_remove (search->debounce_source);
+        search->debounce_source = 0;
+        icon_search_job_destroy (search->job);
+
+    } else if (search->job != NULL) {
+        g_atomic_int_set (&search->job->cancelled, 1);
+    }
+    search->job = NULL;
+}
+
+static inline
+void icon_search_level_destroy (struct icon_search_level_t *level)
+{
+    free (level->query);
+    free (level->matches);
+    *level = ZERO_INIT (struct icon_search_level_t);
+}
+
+void icon_search_reset (struct icon_search_t *search)
+{
+    // Workers read the packed names, wait for them before freeing them. They
+    // were cancelled so this doesn't take long.
+    icon_search_cancel (search);
+    if (search->pool != NULL) {
+        g_thread_pool_free (search->pool, FALSE, TRUE);
+        search->pool = NULL;
+    }
+
+    for (int i=0; i<search->num_levels; i++) {
+        icon_search_level_destroy (&search->levels[i]);
+    }
+    search->num_levels = 0;
+
+    if (search->has_index) {
+        trigram_index_destroy (&search->index);
+        search->has_index = false;
+    }
+
+    if (search->has_packed_names) {
+        packed_names_destroy (&search->packed_names);
+        search->has_packed_names = false;
+    }
+
+    free (search->filter);
+    search->filter = NULL;
+
+    for (int i=0; i<search->num_terms; i++) {
+        free (search->terms[i].text);
+        free (search->terms[i].bits);
+    }
+    search->num_terms = 0;
+    search->next_term = 0;
+}
+
+// Only show rows set in filter from now on, a bitset over the rows of the
+// list allocated with malloc(), or NULL to remove the filter. The search takes
+// ownership of filter. Shown rows don't change until the next call to
+// icon_search_start() or icon_search_apply().
+void icon_search_set_filter (struct icon_search_t *search, uint64_t *filter)
+{
+    free (search->filter);
+    search->filter = filter;
+}
+
+static inline
+bool icon_search_filter_allows (struct icon_search_t *search, uint32_t row)
+{
+    return search->filter == NULL || (search->filter[row/64] & ((uint64_t)1 << (row%64))) != 0;
+}
+
+#ifdef ICON_SEARCH_LATENCY_PROBE
+gboolean icon_search_probe_draw (GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    struct icon_search_t *search = (struct icon_search_t*)data;
+    if (search->probe_pending) {
+        search->probe_pending = false;
+
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        print_time_elapsed (&search->probe_start, &now, "Search query to paint");
+    }
+    return FALSE;
+}
+#endif
+
+// Must be called after the rows of fk_list_box are created. If build_index is
+// true, a trigram index of the rows is created too.
+void icon_search_prepare (struct icon_search_t *search, struct fk_list_box_t *fk_list_box, bool build_index)
+{
+    icon_search_reset (search);
+
+    char **names = malloc (MAX(fk_list_box->num_rows, 1)*sizeof(char*));
+    for (int i=0; i<fk_list_box->num_rows; i++) {
+        names[i] = fk_list_box->rows[i].data;
+    }
+    packed_names_build (&search->packed_names, names, fk_list_box->num_rows);
+    search->has_packed_names = true;
+    free (names);
+
+    if (build_index) {
+        trigram_index_build (&search->index, fk_list_box);
+        search->has_index = true;
+    }
+
+#ifdef ICON_SEARCH_LATENCY_PROBE
+    // A search is always used with the same list widget, except for the
+    // Folder theme where the widget is recreated. Old widgets are destroyed
+    // and their handlers with them.
+    if (search->probe_widget != fk_list_box->widget) {
+        g_signal_connect_after (G_OBJECT(fk_list_box->widget), "draw",
+                                G_CALLBACK (icon_search_probe_draw), search);
+        search->probe_widget = fk_list_box->widget;
+    }
+#endif
+}
+
+static inline
+bool icon_search_is_prefix (const char *prefix, const char *str)
+{
+    return strncmp (prefix, str, strlen (prefix)) == 0;
+}
+
+// Pop all levels that aren't a prefix of query, returns the top level after
+// that or NULL if the stack is empty.
+struct icon_search_level_t* icon_search_pop_levels (struct icon_search_t *search, const char *query)
+{
+    while (search->num_levels > 0 &&
+           !icon_search_is_prefix (search->levels[search->num_levels-1].query, query)) {
+        icon_search_level_destroy (&search->levels[search->num_levels-1]);
+        search->num_levels--;
+    }
+
+    return search->num_levels > 0 ? &search->levels[search->num_levels-1] : NULL;
+}
+
+// Push the result of query, the level takes ownership of matches.
+struct icon_search_level_t* icon_search_push_level (struct icon_search_t *search, const char *query,
+                                                    uint32_t *matches, uint32_t num_matches)
+{
+    // When the stack is full replace the top level, it's a prefix of query so
+    // the result is still correct, we just cache less.
+    if (search->num_levels == ICON_SEARCH_MAX_LEVELS) {
+        search->num_levels--;
+        icon_search_level_destroy (&search->levels[search->num_levels]);
+    }
+
+    struct icon_search_level_t *level = &search->levels[search->num_levels++];
+    level->query = strdup (query);
+    level->matches = matches;
+    level->num_matches = num_matches;
+    return level;
+}
+
+// Computes the rows that contain query (not empty) out of candidates, or all
+// rows if candidates is NULL. Only reads the packed names and the trigram
+// index, so it can be called from a worker thread. Returns a newly allocated
+// array with the matches in matches.
+uint32_t icon_search_exact_matches (struct icon_search_t *search, const char *query,
+                                    uint32_t *candidates, uint32_t num_candidates,
+                                    uint32_t **matches)
+{
+    assert (search->has_packed_names && "icon_search_prepare() wasn't called");
+
+    // We use the matches of the previous query or the trigram index, whichever
+    // gives less candidates.
+    uint32_t *index_candidates = NULL;
+    size_t query_len = strlen (query);
+    if (search->has_index && query_len >= 3) {
+        uint32_t num_index_candidates;
+        if (trigram_index_candidates (&search->index, query, query_len, num_candidates,
+                                      &index_candidates, &num_index_candidates)) {
+            candidates = index_candidates;
+            num_candidates = num_index_candidates;
+        }
+    }
+
+    uint32_t num_matches = 0;
+    uint32_t *res = malloc (MAX(num_candidates, 1)*sizeof(uint32_t));
+    if (candidates == NULL) {
+        packed_names_match_func_t *matcher = packed_names_get_matcher ();
+        num_matches = matcher (&search->packed_names, query, query_len, res);
+
+    } else {
+        for (uint32_t i=0; i<num_candidates; i++) {
+            if (strstr (packed_names_get (&search->packed_names, candidates[i]), query) != NULL) {
+                res[num_matches++] = candidates[i];
+            }
+        }
+    }
+    free (index_candidates);
+
+    *matches = res;
+    return num_matches;
+}
+
+// Hide all rows not in level, or show all of them if level is NULL, rows not
+// in the filter are always hidden. Matches are sorted, so hidden flags can be
+// set in a single pass without comparing any strings.
+void icon_search_show_level (struct icon_search_t *search, struct fk_list_box_t *fk_list_box,
+                             struct icon_search_level_t *level)
+{
+    uint32_t j = 0;
+    for (int i=0; i<fk_list_box->num_rows; i++) {
+        bool in_level = false;
+        if (level == NULL) {
+            in_level = true;
+
+        } else if (j < level->num_matches && level->matches[j] == i) {
+            in_level = true;
+            j++;
+        }
+
+        fk_list_box->rows[i].hidden = !in_level || !icon_search_filter_allows (search, i);
+    }
+    fk_list_box_refresh_hidden (fk_list_box);
+}
+
+// Hide all rows of fk_list_box that don't contain query. This runs
+// synchronously, it's used when the rows of the list change.
+void icon_search_apply (struct icon_search_t *search, struct fk_list_box_t *fk_list_box, const char *query)
+{
+    icon_search_cancel (search);
+
+    struct icon_search_level_t *level = icon_search_pop_levels (search, query);
+    if (*query != '\0' && (level == NULL || strcmp (level->query, query) != 0)) {
+        uint32_t *candidates = NULL;
+        uint32_t num_candidates = fk_list_box->num_rows;
+        if (level != NULL) {
+            candidates = level->matches;
+            num_candidates = level->num_matches;
+        }
+
+        uint32_t *matches;
+        uint32_t num_matches = icon_search_exact_matches (search, query, candidates, num_candidates, &matches);
+        level = icon_search_push_level (search, query, matches, num_matches);
+    }
+
+    icon_search_show_level (search, fk_list_box, *query != '\0' ? level : NULL);
+}
+
+#define ICON_SEARCH_CANCEL_CHECK 1024
+#define FUZZY_SEARCH_MAX_STARTS 8
+
+static inline
+bool fuzzy_is_separator (char c)
+{
+    return c == '-' || c == '_' || c == '.' || c == ' ';
+}
+
+// Score the subsequence match of query in name starting at name[start], which
+// must match query[0]. Matched characters give points, more if they are at the
+// start of the name or of a '-' separated word, or right after the previous
+// match. Characters skipped between matches take points away. Returns false if
+// name doesn't contain query as a subsequence from start.
+bool fuzzy_score_from (const char *name, size_t start, const char *query, size_t query_len, int *score)
+{
+    int res = 0;
+    size_t prev = 0;
+    size_t pos = start;
+    for (size_t i=0; i<query_len; i++) {
+        while (name[pos] != '\0' && g_ascii_tolower (name[pos]) != g_ascii_tolower (query[i])) {
+            pos++;
+        }
+
+        if (name[pos] == '\0') {
+            return false;
+        }
+
+        res += 16;
+        if (pos == 0) {
+            res += 12;
+        } else if (fuzzy_is_separator (name[pos-1])) {
+            res += 10;
+        }
+
+        if (i > 0) {
+            if (pos == prev + 1) {
+                res += 8;
+            } else {
+                res -= MIN(pos - prev - 1, 8);
+            }
+        }
+
+        prev = pos;
+        pos++;
+    }
+
+    *score = res;
+    return true;
+}
+
+// Greedy matching from the first occurrence of query[0] may miss better
+// matches that start later (like "save" in "document-save-as" with query
+// "sa"), so we try up to FUZZY_SEARCH_MAX_STARTS starting positions.
+bool fuzzy_score (const char *name, const char *query, size_t query_len, int *score)
+{
+    bool found = false;
+    int num_starts = 0;
+    for (size_t start=0; name[start] != '\0' && num_starts < FUZZY_SEARCH_MAX_STARTS; start++) {
+        if (g_ascii_tolower (name[start]) == g_ascii_tolower (query[0])) {
+            num_starts++;
+
+            int curr_score;
+            if (!fuzzy_score_from (name, start, query, query_len, &curr_score)) {
+                // Later starts won't match either.
+                break;
+            }
+
+            if (!found || curr_score > *score) {
+                *score = curr_score;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+struct fuzzy_match_t {
+    uint32_t row;
+    int32_t score;
+    uint32_t len;
+};
+
+// Best score first, then shorter names, then the original order.
+//
+// NOTE: We use qsort() instead of templ_sort() because the latter allocates
+// temporary arrays in the stack, with lots of matches this may be too much
+// for a worker thread.
+int fuzzy_match_cmp (const void *a, const void *b)
+{
+    const struct fuzzy_match_t *m_a = a, *m_b = b;
+    if (m_a->score != m_b->score) {
+        return m_a->score > m_b->score ? -1 : 1;
+    } else if (m_a->len != m_b->len) {
+        return m_a->len < m_b->len ? -1 : 1;
+    } else {
+        return m_a->row < m_b->row ? -1 : (m_a->row > m_b->row);
+    }
+}
+
+void icon_search_job_run (gpointer data, gpointer user_data);
+gboolean icon_search_job_done (gpointer data);
+
+void icon_search_job_program_resolve (struct icon_search_job_t *job);
+void icon_search_job_program_run (struct icon_search_job_t *job);
+void icon_search_job_program_done (struct icon_search_job_t *job);
+
+gboolean icon_search_debounce_cb (gpointer data)
+{
+    struct icon_search_t *search = (struct icon_search_t*)data;
+    struct icon_search_job_t *job = search->job;
+    search->debounce_source = 0;
+
+    if (job->program != NULL) {
+        icon_search_job_program_resolve (job);
+    }
+
+    if (job->mode == ICON_SEARCH_EXACT) {
+        struct icon_search_level_t *level = icon_search_pop_levels (search, job->query);
+        if (level != NULL && strcmp (level->query, job->query) == 0) {
+            job->query_cached = true;
+
+        } else if (level != NULL) {
+            job->num_candidates = level->num_matches;
+            job->candidates = malloc (MAX(level->num_matches, 1)*sizeof(uint32_t));
+            memcpy (job->candidates, level->matches, level->num_matches*sizeof(uint32_t));
+        } else {
+            job->num_candidates = job->fk_list_box->num_rows;
+        }
+    }
+
+    if (search->pool == NULL) {
+        search->pool = g_thread_pool_new (icon_search_job_run, NULL, 1, FALSE, NULL);
+    }
+    g_thread_pool_push (search->pool, job, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+// Search query in the background and update fk_list_box when it finishes,
+// this is what should be called while the user types. The search starts
+// ICON_SEARCH_DEBOUNCE_MS after the last call, and each call cancels the
+// previous search. Cheap cases, like an empty query or a query we already
+// have cached, are applied right away unless there is a program. The search
+// takes ownership of program, which can be NULL, see icon_search_query().
+void icon_search_start (struct icon_search_t *search, struct fk_list_box_t *fk_list_box,
+                        const char *query, enum icon_search_mode_t mode,
+                        struct icon_search_job_program_t *program)
+{
+    icon_search_cancel (search);
+
+#ifdef ICON_SEARCH_LATENCY_PROBE
+    clock_gettime (CLOCK_MONOTONIC, &search->probe_start);
+    search->probe_pending = true;
+#endif
+
+    if (program == NULL && *query == '\0') {
+        icon_search_apply (search, fk_list_box, query);
+        return;
+    }
+
+    if (program == NULL && mode == ICON_SEARCH_EXACT) {
+        struct icon_search_level_t *level = icon_search_pop_levels (search, query);
+        if (level != NULL && strcmp (level->query, query) == 0) {
+            icon_search_show_level (search, fk_list_box, level);
+            return;
+        }
+    }
+
+    struct icon_search_job_t *job = malloc (sizeof(struct icon_search_job_t));
+    *job = ZERO_INIT (struct icon_search_job_t);
+    job->search = search;
+    job->fk_list_box = fk_list_box;
+    job->mode = mode;
+    job->query = strdup (query);
+    job->program = program;
+
+    search->job = job;
+    search->debounce_source = g_timeout_add (ICON_SEARCH_DEBOUNCE_MS, icon_search_debounce_cb, search);
+}
+
+void icon_search_fuzzy_matches (struct icon_search_job_t *job)
+{
+    struct packed_names_t *packed = &job->search->packed_names;
+    size_t query_len = strlen (job->query);
+
+    uint32_t num_matches = 0;
+    struct fuzzy_match_t *matches = malloc (MAX(packed->num_names, 1)*sizeof(struct fuzzy_match_t));
+    for (uint32_t i=0; i<packed->num_names; i++) {
+        if (i % ICON_SEARCH_CANCEL_CHECK == 0 && g_atomic_int_get (&job->cancelled)) {
+            break;
+        }
+
+        int score;
+        if (fuzzy_score (packed_names_get (packed, i), job->query, query_len, &score)) {
+            struct fuzzy_match_t *match = &matches[num_matches++];
+            match->row = i;
+            match->score = score;
+            match->len = packed->offsets[i+1] - packed->offsets[i] - 1;
+        }
+    }
+
+    if (!g_atomic_int_get (&job->cancelled)) {
+        qsort (matches, num_matches, sizeof(struct fuzzy_match_t), fuzzy_match_cmp);
+
+        job->rows = malloc (MAX(num_matches, 1)*sizeof(uint32_t));
+        for (uint32_t i=0; i<num_matches; i++) {
+            job->rows[i] = matches[i].row;
+        }
+        job->num_rows = num_matches;
+    }
+    free (matches);
+}
+
+// Runs in the worker thread.
+void icon_search_job_run (gpointer data, gpointer user_data)
+{
+    struct icon_search_job_t *job = (struct icon_search_job_t*)data;
+
+    if (job->program != NULL && !g_atomic_int_get (&job->cancelled)) {
+        icon_search_job_program_run (job);
+    }
+
+    if (!g_atomic_int_get (&job->cancelled) && *job->query != '\0' && !job->query_cached) {
+        if (job->mode == ICON_SEARCH_EXACT) {
+            job->num_rows = icon_search_exact_matches (job->search, job->query,
+                                                       job->candidates, job->num_candidates,
+                                                       &job->rows);
+        } else {
+            icon_search_fuzzy_matches (job);
+        }
+    }
+
+    // Even cancelled jobs go through here so they are freed in the main
+    // thread, where cancellation happens.
+    g_idle_add (icon_search_job_done, job);
+}
+
+// Show only the rows in fuzzy matches, in that order, dropping the ones not
+// in the filter. Matches are modified.
+void icon_search_show_fuzzy (struct icon_search_t *search, struct fk_list_box_t *fk_list_box,
+                             uint32_t *matches, uint32_t num_matches)
+{
+    uint32_t num_rows = 0;
+    for (uint32_t i=0; i<num_matches; i++) {
+        if (icon_search_filter_allows (search, matches[i])) {
+            matches[num_rows++] = matches[i];
+        }
+    }
+    fk_list_box_set_visible_rows (fk_list_box, matches, num_rows);
+}
+
+// Runs in the main thread, results are swapped into the list all at once.
+gboolean icon_search_job_done (gpointer data)
+{
+    struct icon_search_job_t *job = (struct icon_search_job_t*)data;
+    if (!g_atomic_int_get (&job->cancelled)) {
+        struct icon_search_t *search = job->search;
+        assert (search->job == job);
+        search->job = NULL;
+
+        if (job->program != NULL) {
+            icon_search_job_program_done (job);
+        }
+
+        if (*job->query == '\0') {
+            icon_search_show_level (search, job->fk_list_box, icon_search_pop_levels (search, job->query));
+
+        } else if (job->mode == ICON_SEARCH_EXACT) {
+            // Levels only change in the main thread, and any change cancels
+            // the running job, so the top level is still the one the job
+            // started from.
+            struct icon_search_level_t *level;
+            if (job->query_cached) {
+                level = &search->levels[search->num_levels-1];
+            } else {
+                level = icon_search_push_level (search, job->query, job->rows, job->num_rows);
+                job->rows = NULL;
+            }
+            icon_search_show_level (search, job->fk_list_box, level);
+
+        } else {
+            icon_search_show_fuzzy (search, job->fk_list_box, job->rows, job->num_rows);
+        }
+    }
+
+    icon_search_job_destroy (job);
+    return FALSE;
+}
+
+// Same as icon_search_apply() but with fuzzy matching, used when the rows of
+// the list change while in fuzzy mode. Scoring runs synchronously on all rows,
+// fuzzy results aren't cached.
+void icon_search_apply_fuzzy (struct icon_search_t *search, struct fk_list_box_t *fk_list_box, const char *query)
+{
+    icon_search_cancel (search);
+
+    if (*query == '\0') {
+        icon_search_apply (search, fk_list_box, query);
+        return;
+    }
+
+    struct icon_search_job_t job = {0};
+    job.search = search;
+    job.fk_list_box = fk_list_box;
+    job.mode = ICON_SEARCH_FUZZY;
+    job.query = (char*)query;
+    icon_search_fuzzy_matches (&job);
+
+    icon_search_show_fuzzy (search, fk_list_box, job.rows, job.num_rows);
+    free (job.rows);
+}
+
+// Boolean queries
+//
+// The search entry accepts queries made of several terms, like
+//
+//   media- -symbolic | audio-
+//
+// Terms separated by spaces are ANDed, '|' ORs them with lower precedence, a
+// '-' in front of a term or of a parenthesized group negates it. A term of
+// the form key:value is a keyed term if the keyed term callback knows key,
+// otherwise, like any other term, it matches the rows that contain it.
+//
+// Queries are compiled into a postfix program of operations over bitsets of
+// rows. The bitset of each term is cached by its text, so editing one term of
+// a query only recomputes that term. A substring term also starts from the
+// cached substring term with less matches that it contains, so typing a term
+// is incremental like plain searches.
+//
+// The most common query, a single substring maybe with some keyed terms, goes
+// through the normal incremental search instead, so it can be fuzzy. Then the
+// keyed terms become the filter of the search. While typing, programs are
+// evaluated by the same debounced job that searches the substring.
+
+// Sets res to the rows of fk_list_box that match the keyed term key:value,
+// res is a zeroed bitset over the rows. Returns false if key is unknown, then
+// the term is matched as a substring. If res is NULL it only has to tell if
+// key is known. Values may be empty while the user is still typing them,
+// matching all rows then keeps the list from going blank.
+#define ICON_SEARCH_KEYED_TERM_CB(name) \
+    bool name (struct fk_list_box_t *fk_list_box, const char *key, const char *value, \
+               uint64_t *res, void *data)
+typedef ICON_SEARCH_KEYED_TERM_CB(icon_search_keyed_term_cb_t);
+
+enum search_token_type_t {
+    SEARCH_TOKEN_WORD,
+    SEARCH_TOKEN_OR,
+    SEARCH_TOKEN_NOT,
+    SEARCH_TOKEN_OPEN,
+    SEARCH_TOKEN_CLOSE
+};
+
+struct search_token_t {
+    enum search_token_type_t type;
+    char *word;
+};
+
+enum search_op_type_t {
+    SEARCH_OP_TERM,
+    SEARCH_OP_AND,
+    SEARCH_OP_OR,
+    SEARCH_OP_NOT
+};
+
+struct search_op_t {
+    enum search_op_type_t type;
+    char *word;
+};
+
+struct search_program_t {
+    int num_ops;
+    struct search_op_t *ops;
+};
+
+static inline
+int search_query_max_tokens (const char *query)
+{
+    return 2*strlen (query) + 1;
+}
+
+// Split query into tokens, which must have space for
+// search_query_max_tokens(). The '|', '(' and ')' characters are always
+// tokens, and a '-' at the start of a word is a NOT token, unless it's the
+// whole word. Words are allocated in pool. Returns the number of tokens.
+int search_query_tokenize (mem_pool_t *pool, const char *query, struct search_token_t *tokens)
+{
+    int num_tokens = 0;
+    const char *c = query;
+    while (*c) {
+        struct search_token_t *tok = &tokens[num_tokens];
+        if (*c == ' ') {
+            c++;
+            continue;
+
+        } else if (*c == '|' || *c == '(' || *c == ')') {
+            tok->type = *c == '|' ? SEARCH_TOKEN_OR : (*c == '(' ? SEARCH_TOKEN_OPEN : SEARCH_TOKEN_CLOSE);
+            num_tokens++;
+            c++;
+            continue;
+
+        } else if (*c == '-' && c[1] != '\0' && strchr (" |)", c[1]) == NULL) {
+            tok->type = SEARCH_TOKEN_NOT;
+            num_tokens++;
+            c++;
+            continue;
+        }
+
+        const char *word = c;
+        while (*c && *c != ' ' && *c != '|' && *c != '(' && *c != ')') c++;
+        tok->type = SEARCH_TOKEN_WORD;
+        tok->word = pom_strndup (pool, word, c - word);
+        num_tokens++;
+    }
+
+    return num_tokens;
+}
+
+struct search_parser_t {
+    struct search_token_t *tokens;
+    int num_tokens;
+    int pos;
+
+    struct search_program_t *program;
+};
+
+static inline
+void search_parser_emit (struct search_parser_t *parser, enum search_op_type_t type, char *word)
+{
+    struct search_op_t *op = &parser->program->ops[parser->program->num_ops++];
+    op->type = type;
+    op->word = word;
+}
+
+static inline
+bool search_parser_at (struct search_parser_t *parser, enum search_token_type_t type)
+{
+    return parser->pos < parser->num_tokens && parser->tokens[parser->pos].type == type;
+}
+
+// Each parsing function returns false if it didn't emit anything. Incomplete
+// queries are common while typing, so missing operands and parentheses are
+// ignored instead of being errors.
+bool search_parse_or (struct search_parser_t *parser);
+
+bool search_parse_unary (struct search_parser_t *parser)
+{
+    if (search_parser_at (parser, SEARCH_TOKEN_NOT)) {
+        parser->pos++;
+        if (search_parse_unary (parser)) {
+            search_parser_emit (parser, SEARCH_OP_NOT, NULL);
+            return true;
+        }
+        return false;
+
+    } else if (search_parser_at (parser, SEARCH_TOKEN_OPEN)) {
+        parser->pos++;
+        bool emitted = search_parse_or (parser);
+        if (search_parser_at (parser, SEARCH_TOKEN_CLOSE)) {
+            parser->pos++;
+        }
+        return emitted;
+
+    } else if (search_parser_at (parser, SEARCH_TOKEN_WORD)) {
+        search_parser_emit (parser, SEARCH_OP_TERM, parser->tokens[parser->pos].word);
+        parser->pos++;
+        return true;
+
+    } else {
+        return false;
+    }
+}
+
+bool search_parse_and (struct search_parser_t *parser)
+{
+    bool emitted = false;
+    while (search_parser_at (parser, SEARCH_TOKEN_WORD) ||
+           search_parser_at (parser, SEARCH_TOKEN_NOT) ||
+           search_parser_at (parser, SEARCH_TOKEN_OPEN)) {
+        if (search_parse_unary (parser)) {
+            if (emitted) {
+                search_parser_emit (parser, SEARCH_OP_AND, NULL);
+            }
+            emitted = true;
+        }
+    }
+    return emitted;
+}
+
+bool search_parse_or (struct search_parser_t *parser)
+{
+    bool emitted = search_parse_and (parser);
+    while (search_parser_at (parser, SEARCH_TOKEN_OR)) {
+        parser->pos++;
+        if (search_parse_and (parser)) {
+            if (emitted) {
+                search_parser_emit (parser, SEARCH_OP_OR, NULL);
+            }
+            emitted = true;
+        }
+    }
+    return emitted;
+}
+
+// Compile tokens into program, program->ops must have space for 2*num_tokens
+// operations. Unmatched closing parentheses are skipped.
+void search_compile (struct search_token_t *tokens, int num_tokens, struct search_program_t *program)
+{
+    program->num_ops = 0;
+
+    struct search_parser_t parser = {0};
+    parser.tokens = tokens;
+    parser.num_tokens = num_tokens;
+    parser.program = program;
+
+    bool emitted = false;
+    while (parser.pos < num_tokens) {
+        if (search_parse_or (&parser)) {
+            if (emitted) {
+                search_parser_emit (&parser, SEARCH_OP_AND, NULL);
+            }
+            emitted = true;
+        }
+
+        if (search_parser_at (&parser, SEARCH_TOKEN_CLOSE)) {
+            parser.pos++;
+        }
+    }
+}
+
+// If word looks like key:value, splits it into key and value, allocated in
+// pool. Returns false otherwise.
+bool search_word_split_key (mem_pool_t *pool, const char *word, char **key, char **value)
+{
+    const char *colon = strchr (word, ':');
+    if (colon == NULL || colon == word) {
+        return false;
+    }
+
+    *key = pom_strndup (pool, word, colon - word);
+    *value = pom_strdup (pool, colon + 1);
+    return true;
+}
+
+bool icon_search_is_keyed (struct fk_list_box_t *fk_list_box, const char *word,
+                           icon_search_keyed_term_cb_t *keyed_term_cb, void *data)
+{
+    mem_pool_t pool = {0};
+    char *key, *value;
+    bool is_keyed = keyed_term_cb != NULL && search_word_split_key (&pool, word, &key, &value) &&
+        keyed_term_cb (fk_list_box, key, value, NULL, data);
+    mem_pool_destroy (&pool);
+    return is_keyed;
+}
+
+static inline
+uint32_t icon_search_num_words (uint32_t num_rows)
+{
+    return (num_rows + 63)/64;
+}
+
+// Clears the bits after the last row.
+static inline
+void icon_search_bits_mask (uint32_t num_rows, uint64_t *bits)
+{
+    if (num_rows % 64 != 0) {
+        bits[num_rows/64] &= ((uint64_t)1 << (num_rows%64)) - 1;
+    }
+}
+
+// Returns the cached term for word, or NULL if it isn't cached.
+struct icon_search_term_t* icon_search_lookup_term (struct icon_search_t *search, const char *word)
+{
+    for (int i=0; i<search->num_terms; i++) {
+        if (strcmp (search->terms[i].text, word) == 0) {
+            return &search->terms[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the cached substring term with less matches that is contained in
+// word, or NULL if there is none. Any row that contains word also contains
+// it, so only its rows are candidates for word.
+struct icon_search_term_t* icon_search_smallest_containing (struct icon_search_t *search, const char *word)
+{
+    struct icon_search_term_t *smallest_containing = NULL;
+    for (int i=0; i<search->num_terms; i++) {
+        struct icon_search_term_t *term = &search->terms[i];
+        if (!term->is_keyed && strstr (word, term->text) != NULL &&
+            (smallest_containing == NULL || term->count < smallest_containing->count)) {
+            smallest_containing = term;
+        }
+    }
+    return smallest_containing;
+}
+
+// Add a term to the cache, it takes ownership of bits. When the cache is full
+// the oldest term is replaced. The pointer is valid until the next call.
+struct icon_search_term_t* icon_search_cache_term (struct icon_search_t *search, const char *word,
+                                                   bool is_keyed, uint64_t *bits)
+{
+    struct icon_search_term_t *term;
+    if (search->num_terms < ICON_SEARCH_MAX_TERMS) {
+        term = &search->terms[search->num_terms++];
+    } else {
+        term = &search->terms[search->next_term];
+        search->next_term = (search->next_term + 1) % ICON_SEARCH_MAX_TERMS;
+        free (term->text);
+        free (term->bits);
+    }
+
+    term->text = strdup (word);
+    term->is_keyed = is_keyed;
+    term->bits = bits;
+    term->count = 0;
+    uint32_t num_words = icon_search_num_words (search->packed_names.num_names);
+    for (uint32_t w=0; w<num_words; w++) {
+        term->count += __builtin_popcountll (bits[w]);
+    }
+    return term;
+}
+
+// Computes the bitset of the rows that contain word, out of the rows set in
+// candidates, or all rows if candidates is NULL. Only reads the packed names
+// and the trigram index, so it can be called from a worker thread.
+uint64_t* icon_search_substring_bits (struct icon_search_t *search, const char *word, uint64_t *candidates)
+{
+    uint32_t num_rows = search->packed_names.num_names;
+    uint32_t num_words = icon_search_num_words (num_rows);
+    uint64_t *bits = calloc (MAX(num_words, 1), sizeof(uint64_t));
+
+    uint32_t *candidate_rows = NULL;
+    uint32_t num_candidates = num_rows;
+    if (candidates != NULL) {
+        num_candidates = 0;
+        candidate_rows = malloc (MAX(num_rows, 1)*sizeof(uint32_t));
+        for (uint32_t w=0; w<num_words; w++) {
+            uint64_t word_bits = candidates[w];
+            while (word_bits != 0) {
+                candidate_rows[num_candidates++] = w*64 + __builtin_ctzll (word_bits);
+                word_bits &= word_bits - 1;
+            }
+        }
+    }
+
+    uint32_t *matches;
+    uint32_t num_matches =
+        icon_search_exact_matches (search, word, candidate_rows, num_candidates, &matches);
+    for (uint32_t i=0; i<num_matches; i++) {
+        bits[matches[i]/64] |= (uint64_t)1 << (matches[i]%64);
+    }
+    free (matches);
+    free (candidate_rows);
+
+    return bits;
+}
+
+// Returns the cached term for word, computing it if necessary. The pointer is
+// valid until the next call.
+struct icon_search_term_t* icon_search_get_term (struct icon_search_t *search,
+                                                 struct fk_list_box_t *fk_list_box, char *word,
+                                                 icon_search_keyed_term_cb_t *keyed_term_cb, void *data)
+{
+    struct icon_search_term_t *term = icon_search_lookup_term (search, word);
+    if (term != NULL) {
+        return term;
+    }
+
+    uint32_t num_words = icon_search_num_words (fk_list_box->num_rows);
+    uint64_t *bits = calloc (MAX(num_words, 1), sizeof(uint64_t));
+
+    mem_pool_t pool = {0};
+    char *key, *value;
+    bool is_keyed = keyed_term_cb != NULL && search_word_split_key (&pool, word, &key, &value) &&
+        keyed_term_cb (fk_list_box, key, value, bits, data);
+    mem_pool_destroy (&pool);
+
+    if (is_keyed) {
+        icon_search_bits_mask (fk_list_box->num_rows, bits);
+
+    } else {
+        free (bits);
+        struct icon_search_term_t *smallest_containing = icon_search_smallest_containing (search, word);
+        bits = icon_search_substring_bits (search, word,
+                                           smallest_containing != NULL ? smallest_containing->bits : NULL);
+    }
+
+    return icon_search_cache_term (search, word, is_keyed, bits);
+}
+
+// Runs program over bitsets of num_rows rows, term_bits has the bitset of each
+// SEARCH_OP_TERM operation in the order they appear in the program. Returns
+// the resulting bitset allocated with malloc(). It doesn't touch any search
+// state, so it can run in a worker thread.
+uint64_t* search_program_eval (struct search_program_t *program, uint64_t **term_bits, uint32_t num_rows)
+{
+    assert (program->num_ops > 0);
+
+    uint32_t num_words = MAX(icon_search_num_words (num_rows), 1);
+    uint64_t *stack = malloc (program->num_ops*num_words*sizeof(uint64_t));
+    int stack_len = 0;
+    int num_terms = 0;
+
+    for (int i=0; i<program->num_ops; i++) {
+        struct search_op_t *op = &program->ops[i];
+        if (op->type == SEARCH_OP_TERM) {
+            memcpy (stack + stack_len*num_words, term_bits[num_terms++], num_words*sizeof(uint64_t));
+            stack_len++;
+            continue;
+        }
+
+        // The parser only emits operators after their operands.
+        assert (stack_len >= (op->type == SEARCH_OP_NOT ? 1 : 2));
+        uint64_t *top = stack + (stack_len - 1)*num_words;
+
+        if (op->type == SEARCH_OP_NOT) {
+            for (uint32_t w=0; w<num_words; w++) {
+                top[w] = ~top[w];
+            }
+            icon_search_bits_mask (num_rows, top);
+
+        } else {
+            uint64_t *second = top - num_words;
+            for (uint32_t w=0; w<num_words; w++) {
+                second[w] = op->type == SEARCH_OP_AND ? second[w] & top[w] : second[w] | top[w];
+            }
+            stack_len--;
+        }
+    }
+    assert (stack_len == 1);
+
+    return realloc (stack, num_words*sizeof(uint64_t));
+}
+
+// Runs program over the rows of fk_list_box in the main thread. Returns the
+// resulting bitset allocated with malloc(), or NULL if the program is empty.
+uint64_t* icon_search_eval (struct icon_search_t *search, struct fk_list_box_t *fk_list_box,
+                            struct search_program_t *program,
+                            icon_search_keyed_term_cb_t *keyed_term_cb, void *data)
+{
+    if (program->num_ops == 0) {
+        return NULL;
+    }
+
+    // Terms are copied because getting a term may replace the cached ones we
+    // got before.
+    uint32_t num_words = MAX(icon_search_num_words (fk_list_box->num_rows), 1);
+    uint64_t *bits = malloc (program->num_ops*num_words*sizeof(uint64_t));
+    uint64_t **term_bits = malloc (program->num_ops*sizeof(uint64_t*));
+    int num_terms = 0;
+    for (int i=0; i<program->num_ops; i++) {
+        if (program->ops[i].type == SEARCH_OP_TERM) {
+            struct icon_search_term_t *term =
+                icon_search_get_term (search, fk_list_box, program->ops[i].word, keyed_term_cb, data);
+            term_bits[num_terms] = bits + num_terms*num_words;
+            memcpy (term_bits[num_terms], term->bits, num_words*sizeof(uint64_t));
+            num_terms++;
+        }
+    }
+
+    uint64_t *res = search_program_eval (program, term_bits, fk_list_box->num_rows);
+    free (term_bits);
+    free (bits);
+    return res;
+}
+
+// A term of a program evaluated by a search job. bits is set for keyed terms
+// and for terms that were cached when the job started. Otherwise the worker
+// computes it out of the rows set in candidates, or all rows if candidates is
+// NULL.
+struct icon_search_job_term_t {
+    char *text;
+    bool computed;
+    uint64_t *candidates;
+    uint64_t *bits;
+};
+
+// Boolean part of a query searched in the background. The program is compiled
+// in the main thread, its keyed terms are resolved there too when the
+// debounce timeout fires because keyed term callbacks read application state.
+// Substring terms and the program itself are evaluated by the worker, and the
+// result becomes the filter of the search when the job finishes.
+struct icon_search_job_program_t {
+    mem_pool_t pool;
+    struct search_program_t program;
+    icon_search_keyed_term_cb_t *keyed_term_cb;
+    void *data;
+
+    // Terms in the order they appear in program.
+    uint32_t num_rows;
+    int num_terms;
+    struct icon_search_job_term_t *terms;
+
+    uint64_t *filter;
+};
+
+struct icon_search_job_program_t* icon_search_job_program_new (struct search_program_t *program,
+                                                               icon_search_keyed_term_cb_t *keyed_term_cb,
+                                                               void *data)
+{
+    struct icon_search_job_program_t *job_program = malloc (sizeof(struct icon_search_job_program_t));
+    *job_program = ZERO_INIT (struct icon_search_job_program_t);
+    job_program->keyed_term_cb = keyed_term_cb;
+    job_program->data = data;
+
+    job_program->program.num_ops = program->num_ops;
+    job_program->program.ops = pom_push_array (&job_program->pool, program->num_ops, struct search_op_t);
+    job_program->terms =
+        pom_push_array (&job_program->pool, program->num_ops, struct icon_search_job_term_t);
+    for (int i=0; i<program->num_ops; i++) {
+        struct search_op_t *op = &job_program->program.ops[i];
+        *op = program->ops[i];
+        if (op->type == SEARCH_OP_TERM) {
+            op->word = pom_strdup (&job_program->pool, op->word);
+
+            struct icon_search_job_term_t *term = &job_program->terms[job_program->num_terms++];
+            *term = ZERO_INIT (struct icon_search_job_term_t);
+            term->text = op->word;
+        }
+    }
+
+    return job_program;
+}
+
+void icon_search_job_program_destroy (struct icon_search_job_program_t *job_program)
+{
+    for (int i=0; i<job_program->num_terms; i++) {
+        free (job_program->terms[i].candidates);
+        free (job_program->terms[i].bits);
+    }
+    free (job_program->filter);
+    mem_pool_destroy (&job_program->pool);
+    free (job_program);
+}
+
+// Runs in the main thread when the debounce timeout of job fires.
+void icon_search_job_program_resolve (struct icon_search_job_t *job)
+{
+    struct icon_search_job_program_t *job_program = job->program;
+    struct icon_search_t *search = job->search;
+    struct fk_list_box_t *fk_list_box = job->fk_list_box;
+
+    job_program->num_rows = fk_list_box->num_rows;
+    size_t bits_size = MAX(icon_search_num_words (fk_list_box->num_rows), 1)*sizeof(uint64_t);
+    for (int i=0; i<job_program->num_terms; i++) {
+        struct icon_search_job_term_t *job_term = &job_program->terms[i];
+
+        struct icon_search_term_t *term = icon_search_lookup_term (search, job_term->text);
+        if (term == NULL &&
+            icon_search_is_keyed (fk_list_box, job_term->text, job_program->keyed_term_cb, job_program->data)) {
+            term = icon_search_get_term (search, fk_list_box, job_term->text,
+                                         job_program->keyed_term_cb, job_program->data);
+        }
+
+        if (term != NULL) {
+            job_term->bits = malloc (bits_size);
+            memcpy (job_term->bits, term->bits, bits_size);
+
+        } else {
+            term = icon_search_smallest_containing (search, job_term->text);
+            if (term != NULL) {
+                job_term->candidates = malloc (bits_size);
+                memcpy (job_term->candidates, term->bits, bits_size);
+            }
+        }
+    }
+}
+
+// Runs in the worker thread.
+void icon_search_job_program_run (struct icon_search_job_t *job)
+{
+    struct icon_search_job_program_t *job_program = job->program;
+
+    uint64_t **term_bits = malloc (MAX(job_program->num_terms, 1)*sizeof(uint64_t*));
+    for (int i=0; i<job_program->num_terms; i++) {
+        if (g_atomic_int_get (&job->cancelled)) {
+            free (term_bits);
+            return;
+        }
+
+        struct icon_search_job_term_t *job_term = &job_program->terms[i];
+        if (job_term->bits == NULL) {
+            job_term->bits = icon_search_substring_bits (job->search, job_term->text, job_term->candidates);
+            job_term->computed = true;
+        }
+        term_bits[i] = job_term->bits;
+    }
+
+    job_program->filter = search_program_eval (&job_program->program, term_bits, job_program->num_rows);
+    free (term_bits);
+}
+
+// Runs in the main thread when job finishes without being cancelled. Terms
+// computed by the worker are cached, and the result becomes the filter.
+void icon_search_job_program_done (struct icon_search_job_t *job)
+{
+    struct icon_search_job_program_t *job_program = job->program;
+    struct icon_search_t *search = job->search;
+
+    for (int i=0; i<job_program->num_terms; i++) {
+        struct icon_search_job_term_t *job_term = &job_program->terms[i];
+        if (job_term->computed && icon_search_lookup_term (search, job_term->text) == NULL) {
+            icon_search_cache_term (search, job_term->text, false, job_term->bits);
+            job_term->bits = NULL;
+        }
+    }
+
+    icon_search_set_filter (search, job_program->filter);
+    job_program->filter = NULL;
+}
+
+// Search the query typed in the search entry, which may be a boolean query,
+// and show the results in fk_list_box. See icon_search_start() for async, and
+// ICON_SEARCH_KEYED_TERM_CB for keyed_term_cb, which can be NULL. Fuzzy
+// matching only applies to single substring queries.
+//
+// When async is false the query is evaluated right away, this is used when the
+// rows of the list change so it never shows rows that don't match. Otherwise
+// only compiling the query happens here, evaluating it is part of the
+// debounced search job.
+void icon_search_query (struct icon_search_t *search, struct fk_list_box_t *fk_list_box,
+                        const char *query, enum icon_search_mode_t mode, bool async,
+                        icon_search_keyed_term_cb_t *keyed_term_cb, void *data)
+{
+    // NOTE: Arrays are allocated before any string so they are aligned.
+    mem_pool_t pool = {0};
+    int max_tokens = search_query_max_tokens (query);
+    struct search_token_t *tokens = pom_push_array (&pool, max_tokens, struct search_token_t);
+    struct search_program_t program;
+    program.ops = pom_push_array (&pool, 2*max_tokens, struct search_op_t);
+    int num_tokens = search_query_tokenize (&pool, query, tokens);
+
+    // Check if this is a single substring with keyed terms, in that case the
+    // substring is searched as text and the keyed terms are the filter.
+    char *text = NULL;
+    bool is_boolean = false;
+    for (int i=0; i<num_tokens && !is_boolean; i++) {
+        if (tokens[i].type != SEARCH_TOKEN_WORD) {
+            is_boolean = true;
+
+        } else if (!icon_search_is_keyed (fk_list_box, tokens[i].word, keyed_term_cb, data)) {
+            is_boolean = text != NULL;
+            text = tokens[i].word;
+        }
+    }
+
+    if (is_boolean) {
+        search_compile (tokens, num_tokens, &program);
+        text = "";
+
+    } else {
+        int num_keyed = 0;
+        for (int i=0; i<num_tokens; i++) {
+            if (tokens[i].word != text) {
+                tokens[num_keyed++] = tokens[i];
+            }
+        }
+        search_compile (tokens, num_keyed, &program);
+        if (text == NULL) {
+            text = "";
+        }
+    }
+
+    enum icon_search_mode_t text_mode =
+        mode == ICON_SEARCH_FUZZY && !is_boolean ? ICON_SEARCH_FUZZY : ICON_SEARCH_EXACT;
+    if (async && program.num_ops > 0) {
+        icon_search_start (search, fk_list_box, text, text_mode,
+                           icon_search_job_program_new (&program, keyed_term_cb, data));
+
+    } else {
+        icon_search_set_filter (search, icon_search_eval (search, fk_list_box, &program, keyed_term_cb, data));
+
+        if (async) {
+            icon_search_start (search, fk_list_box, text, text_mode, NULL);
+        } else if (text_mode == ICON_SEARCH_FUZZY) {
+            icon_search_apply_fuzzy (search, fk_list_box, text);
+        } else {
+            icon_search_apply (search, fk_list_box, text);
+        }
+    }
+    mem_pool_destroy (&pool);
+}
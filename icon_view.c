@@ -2,20 +2,6 @@
  * Copiright (C) 2018 Santiago León O.
  */
 
-#define UNSELECTED_ICON_BOX_STYLE       \
-"box {"                                 \
-"    padding: 6px;"                     \
-"    border-radius: 3px;"               \
-"    border: 1px solid rgba(0,0,0,0);"  \
-"}"
-
-#define SELECTED_ICON_BOX_STYLE \
-"box {"                         \
-"    padding: 6px;"             \
-"    border-radius: 3px;"       \
-"    border: 1px solid #777;"   \
-"}"
-
 GtkWidget *spaced_grid_new (int spacing)
 {
     GtkWidget *new_grid = gtk_grid_new ();
@@ -135,40 +121,18 @@ GtkWidget* image_data_dpy_new (struct icon_image_t *img)
     return data;
 }
 
-void set_icon_box_border (struct icon_image_t *img)
+void icon_view_update_image_data_dpy (struct icon_view_t *icon_view, struct icon_image_t *img)
 {
-    img->custom_css = replace_custom_css (img->box, img->custom_css, SELECTED_ICON_BOX_STYLE);
+    g_assert (icon_view->image_data_dpy != NULL);
+    GtkWidget *image_data_dpy = image_data_dpy_new (img);
+
+    GtkWidget *parent = gtk_widget_get_parent (icon_view->image_data_dpy);
+    gtk_container_remove (GTK_CONTAINER(parent), icon_view->image_data_dpy);
+    gtk_container_add (GTK_CONTAINER(parent), image_data_dpy);
+    icon_view->image_data_dpy = image_data_dpy;
+    gtk_widget_show_all (image_data_dpy);
 }
 
-void unset_icon_box_border (struct icon_image_t *img)
-{
-    img->custom_css = replace_custom_css (img->box, img->custom_css, UNSELECTED_ICON_BOX_STYLE);
-}
-
-gboolean on_image_clicked (GtkWidget *widget, GdkEvent *event, gpointer user_data)
-{
-    struct icon_image_t *img = (struct icon_image_t *)user_data;
-    if (img->view->selected_img != img) {
-        GtkWidget *image_data_dpy = image_data_dpy_new (img);
-        g_assert (img->view->image_data_dpy != NULL);
-
-        unset_icon_box_border (img->view->selected_img);
-
-        img->view->selected_img = img;
-        set_icon_box_border (img);
-
-        // Replace image_data_dpy widget
-        GtkWidget *parent = gtk_widget_get_parent (img->view->image_data_dpy);
-        gtk_container_remove (GTK_CONTAINER(parent), img->view->image_data_dpy);
-        gtk_container_add (GTK_CONTAINER(parent), image_data_dpy);
-        img->view->image_data_dpy = image_data_dpy;
-        gtk_widget_show_all (image_data_dpy);
-    }
-
-    // NOTE: We allways let the event go through so we have drag and drop even
-    // if the image wasn't selected.
-    return FALSE;
-}
 
 char* new_bgcolor_style_str (mem_pool_t *pool, char *node_name, dvec4 color)
 {
@@ -202,12 +166,251 @@ void on_color_button_clicked (GtkColorButton *button, gpointer user_data)
     app.bg_color = color;
 }
 
-void on_drag_data_get (GtkWidget *widget, GdkDragContext *context, GtkSelectionData *data,
-                       guint info, guint time, gpointer user_data)
+// Images of the icon display are drawn into a single GtkDrawingArea. Before,
+// each image had a GtkEventBox, a GtkBox, a GtkImage and a GtkCssProvider for
+// its border. The GtkImages had to live as long as the icon view because
+// changing the scale destroyed their containers, so they were ref sinked and
+// unparented by hand. Now an image is just its icon_image_t in the icon view's
+// pool plus a cairo surface, and its box is computed by icon_view_layout().
+// The layout is the same we had with widgets: boxes are aligned to the bottom
+// and separated by ICON_BOX_SPACING, and each box has a border of
+// ICON_BOX_BORDER that is only visible for the selected image.
+#define ICON_BOX_PADDING 6
+#define ICON_BOX_BORDER 1
+#define ICON_BOX_SPACING 12
+#define ICON_BOX_BORDER_RADIUS 3
+#define ICON_BOX_SELECTED_COLOR RGB_255(0x77,0x77,0x77)
+
+// Size of the image shown for files that couldn't be decoded.
+#define ICON_MISSING_SIZE 48
+
+// NOTE: At least one package (aptdaemon-data) provides animated icons in a
+// single file by appending the frames side by side. We detect that case using
+// the first image of a scale, and instead display these icons vertically.
+static inline
+bool icon_image_is_animation (struct icon_image_t *img)
+{
+    return img->height > 0 && img->width/img->height > 2;
+}
+
+cairo_surface_t* icon_missing_surface ()
+{
+    static cairo_surface_t *surface = NULL;
+    if (surface == NULL) {
+        GdkPixbuf *pixbuf = gtk_icon_theme_load_icon (gtk_icon_theme_get_default (), "image-missing",
+                                                      ICON_MISSING_SIZE, 0, NULL);
+        if (pixbuf != NULL) {
+            surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, 1, NULL);
+            g_object_unref (pixbuf);
+        }
+    }
+    return surface;
+}
+
+// The surface drawn for img, can be NULL.
+static inline
+cairo_surface_t* icon_image_get_surface (struct icon_image_t *img)
+{
+    return img->load_failed ? icon_missing_surface () : img->surface;
+}
+
+// Size of the space taken by img in the icon display. Until the file is
+// decoded we use the size from the file header, or the nominal one.
+void icon_image_get_size (struct icon_image_t *img, int *width, int *height)
+{
+    if (img->width > 0 && img->height > 0) {
+        *width = img->width;
+        *height = img->height;
+    } else if (img->load_failed) {
+        *width = ICON_MISSING_SIZE;
+        *height = ICON_MISSING_SIZE;
+    } else if (img->size > 0) {
+        *width = img->size*img->scale;
+        *height = img->size*img->scale;
+    } else {
+        *width = 0;
+        *height = 0;
+    }
+}
+
+// Compute the boxes of the images of the scale being shown, and set the size
+// request of the icon area to the size of all of them.
+void icon_view_layout (struct icon_view_t *icon_view)
+{
+    struct icon_image_t *first = icon_view->images[icon_view->scale-1];
+    bool vertical = icon_image_is_animation (first);
+    PangoLayout *layout = gtk_widget_create_pango_layout (icon_view->icon_area, NULL);
+
+    int max_width = 0, max_height = 0;
+    for (struct icon_image_t *img = first; img != NULL; img = img->next) {
+        int width, height;
+        icon_image_get_size (img, &width, &height);
+
+        if (img->label != NULL) {
+            int label_width, label_height;
+            pango_layout_set_text (layout, img->label, -1);
+            pango_layout_get_pixel_size (layout, &label_width, &label_height);
+            width = MAX (width, label_width);
+            height += ICON_BOX_SPACING + label_height;
+        }
+
+        img->box.width = width + 2*(ICON_BOX_PADDING + ICON_BOX_BORDER);
+        img->box.height = height + 2*(ICON_BOX_PADDING + ICON_BOX_BORDER);
+        max_width = MAX (max_width, img->box.width);
+        max_height = MAX (max_height, img->box.height);
+    }
+
+    int x = 0, y = 0;
+    for (struct icon_image_t *img = first; img != NULL; img = img->next) {
+        if (vertical) {
+            img->box.x = 0;
+            img->box.y = y;
+            img->box.width = max_width;
+            y += img->box.height + ICON_BOX_SPACING;
+        } else {
+            img->box.x = x;
+            img->box.y = max_height - img->box.height;
+            x += img->box.width + ICON_BOX_SPACING;
+        }
+    }
+
+    if (vertical) {
+        gtk_widget_set_size_request (icon_view->icon_area, max_width, MAX (y - ICON_BOX_SPACING, 0));
+    } else {
+        gtk_widget_set_size_request (icon_view->icon_area, MAX (x - ICON_BOX_SPACING, 0), max_height);
+    }
+
+    g_object_unref (layout);
+}
+
+void cairo_rounded_rectangle (cairo_t *cr, double x, double y, double width, double height, double r)
 {
-    struct icon_image_t *img = (struct icon_image_t *)user_data;
+    cairo_new_sub_path (cr);
+    cairo_arc (cr, x + width - r, y + r, r, -M_PI/2, 0);
+    cairo_arc (cr, x + width - r, y + height - r, r, 0, M_PI/2);
+    cairo_arc (cr, x + r, y + height - r, r, M_PI/2, M_PI);
+    cairo_arc (cr, x + r, y + r, r, M_PI, 3*M_PI/2);
+    cairo_close_path (cr);
+}
+
+gboolean icon_area_draw (GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    struct icon_view_t *icon_view = (struct icon_view_t *)data;
+    // NOTE: An icon area that is being replaced by a deferred widget
+    // replacement may be drawn after the icon view changed.
+    if (widget != icon_view->icon_area) {
+        return FALSE;
+    }
+
+    GtkStyleContext *style = gtk_widget_get_style_context (widget);
+    GdkRGBA text_color;
+    gtk_style_context_get_color (style, gtk_style_context_get_state (style), &text_color);
+
+    PangoLayout *layout = gtk_widget_create_pango_layout (widget, NULL);
+    pango_layout_set_alignment (layout, PANGO_ALIGN_CENTER);
+
+    for (struct icon_image_t *img = icon_view->images[icon_view->scale-1]; img != NULL; img = img->next) {
+        GdkRectangle *box = &img->box;
+        if (img == icon_view->selected_img) {
+            cairo_set_line_width (cr, ICON_BOX_BORDER);
+            cairo_rounded_rectangle (cr, box->x + 0.5*ICON_BOX_BORDER, box->y + 0.5*ICON_BOX_BORDER,
+                                     box->width - ICON_BOX_BORDER, box->height - ICON_BOX_BORDER,
+                                     ICON_BOX_BORDER_RADIUS);
+            cairo_set_source_rgb (cr, ARGS_RGB(ICON_BOX_SELECTED_COLOR));
+            cairo_stroke (cr);
+        }
+
+        int content_x = box->x + ICON_BOX_PADDING + ICON_BOX_BORDER;
+        int content_y = box->y + ICON_BOX_PADDING + ICON_BOX_BORDER;
+        int content_width = box->width - 2*(ICON_BOX_PADDING + ICON_BOX_BORDER);
+
+        int width, height;
+        icon_image_get_size (img, &width, &height);
+
+        // Surfaces are centered in the space of the image, this only matters
+        // for the image of files that couldn't be decoded.
+        cairo_surface_t *surface = icon_image_get_surface (img);
+        if (surface != NULL) {
+            int surface_width = cairo_image_surface_get_width (surface);
+            int surface_height = cairo_image_surface_get_height (surface);
+            cairo_set_source_surface (cr, surface,
+                                      content_x + (content_width - surface_width)/2,
+                                      content_y + (height - surface_height)/2);
+            cairo_paint (cr);
+        }
+
+        if (img->label != NULL) {
+            int label_width, label_height;
+            pango_layout_set_text (layout, img->label, -1);
+            pango_layout_get_pixel_size (layout, &label_width, &label_height);
+            cairo_move_to (cr, content_x + (content_width - label_width)/2,
+                           content_y + height + ICON_BOX_SPACING);
+            gdk_cairo_set_source_rgba (cr, &text_color);
+            pango_cairo_show_layout (cr, layout);
+        }
+    }
+
+    g_object_unref (layout);
+    return FALSE;
+}
+
+struct icon_image_t* icon_view_image_at (struct icon_view_t *icon_view, int x, int y)
+{
+    for (struct icon_image_t *img = icon_view->images[icon_view->scale-1]; img != NULL; img = img->next) {
+        GdkRectangle *box = &img->box;
+        if (x >= box->x && x < box->x + box->width && y >= box->y && y < box->y + box->height) {
+            return img;
+        }
+    }
+    return NULL;
+}
+
+gboolean on_icon_area_button_press (GtkWidget *widget, GdkEventButton *event, gpointer user_data)
+{
+    struct icon_view_t *icon_view = (struct icon_view_t *)user_data;
+    if (widget != icon_view->icon_area) {
+        return FALSE;
+    }
+
+    struct icon_image_t *img = icon_view_image_at (icon_view, event->x, event->y);
+    icon_view->pressed_img = img;
+    if (img == NULL) {
+        // Stop the event so clicks outside images don't start a drag.
+        return TRUE;
+    }
+
+    if (img != icon_view->selected_img) {
+        icon_view->selected_img = img;
+        gtk_widget_queue_draw (widget);
+        icon_view_update_image_data_dpy (icon_view, img);
+    }
+
+    // NOTE: We allways let the event go through so we have drag and drop even
+    // if the image wasn't selected.
+    return FALSE;
+}
+
+void on_icon_area_drag_begin (GtkWidget *widget, GdkDragContext *context, gpointer user_data)
+{
+    struct icon_view_t *icon_view = (struct icon_view_t *)user_data;
+    if (icon_view->pressed_img != NULL) {
+        cairo_surface_t *surface = icon_image_get_surface (icon_view->pressed_img);
+        if (surface != NULL) {
+            gtk_drag_set_icon_surface (context, surface);
+        }
+    }
+}
+
+void on_icon_area_drag_data_get (GtkWidget *widget, GdkDragContext *context, GtkSelectionData *data,
+                                 guint info, guint time, gpointer user_data)
+{
+    struct icon_view_t *icon_view = (struct icon_view_t *)user_data;
+    if (icon_view->pressed_img == NULL) {
+        return;
+    }
+
     string_t uri = str_new ("file://");
-    str_cat_c (&uri, img->full_path);
+    str_cat_c (&uri, icon_view->pressed_img->full_path);
 
     char *uris[] = {str_data(&uri), NULL};
     gtk_selection_data_set_uris (data, uris);
@@ -215,66 +418,212 @@ void on_drag_data_get (GtkWidget *widget, GdkDragContext *context, GtkSelectionD
     str_free (&uri);
 }
 
-GtkWidget* icon_view_create_icon_dpy (struct icon_view_t *icon_view, int scale)
+void on_icon_area_destroy (GtkWidget *widget, gpointer user_data)
 {
-    // NOTE: At least one package (aptdaemon-data) provides animated icons in a
-    // single file by appending the frames side by side.  Here we detect that
-    // case and instead display these icons vertically.
-    GtkOrientation all_icons_or = icon_view->images[scale-1]->width/icon_view->images[scale-1]->height > 2 ?
-        GTK_ORIENTATION_VERTICAL : GTK_ORIENTATION_HORIZONTAL;
-    GtkWidget *all_icons = gtk_box_new (all_icons_or, 12);
+    struct icon_view_t *icon_view = (struct icon_view_t *)user_data;
+    if (icon_view->icon_area == widget) {
+        icon_view->icon_area = NULL;
+    }
+}
 
-    struct icon_image_t *last_img = NULL;
-    struct icon_image_t *img = icon_view->images[scale-1];
+// The icon display may already be showing img, in that case everything that
+// depends on its size is updated.
+void icon_image_size_changed (struct icon_image_t *img)
+{
+    struct icon_view_t *icon_view = img->view;
+    if (icon_view->icon_area != NULL && MAX(img->scale, 1) == icon_view->scale) {
+        icon_view_layout (icon_view);
+        gtk_widget_queue_draw (icon_view->icon_area);
 
-    while (img != NULL) {
-        GtkWidget *box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 12);
-        img->box = box;
-        img->custom_css = add_custom_css (box, UNSELECTED_ICON_BOX_STYLE);
+        if (img == icon_view->selected_img) {
+            icon_view_update_image_data_dpy (icon_view, img);
+        }
+    }
+}
+
+// Called when the file of img is decoded, pixbuf is NULL if that failed.
+PIXBUF_LOADER_DONE_CB (icon_image_loaded)
+{
+    struct icon_image_t *img = (struct icon_image_t *)data;
+    img->file_size = file_size;
 
-        gtk_widget_set_valign (box,GTK_ALIGN_END);
-        gtk_widget_set_vexpand (box, FALSE);
+    if (pixbuf != NULL) {
+        img->surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, 1, NULL);
+        img->width = gdk_pixbuf_get_width (pixbuf);
+        img->height = gdk_pixbuf_get_height (pixbuf);
+    } else {
+        img->load_failed = true;
+    }
 
-        gtk_container_add (GTK_CONTAINER(box), img->image);
+    icon_image_size_changed (img);
+}
 
-        if (img->label != NULL) {
-            GtkWidget *label = gtk_label_new (img->label);
-            gtk_widget_set_valign (label, GTK_ALIGN_START);
-            gtk_label_set_justify (GTK_LABEL(label), GTK_JUSTIFY_CENTER);
-            gtk_container_add (GTK_CONTAINER(box), label);
+// Sizes of the images of a scale are read from their headers by a worker
+// thread, paths are copied because the icon view may be freed while it runs.
+// Results are only used if the generation of the icon view didn't change.
+struct icon_view_probe_t {
+    gint *generation;
+    gint expected_generation;
+
+    int num_images;
+    struct icon_image_t **images;
+    char **paths;
+
+    // Result for each image, ok is false if the size isn't known.
+    struct {
+        bool ok;
+        int width, height;
+        off_t file_size;
+    } *sizes;
+};
+
+// Runs in the main thread. Images that were already decoded keep the size of
+// their pixbuf.
+gboolean icon_view_probe_done (gpointer data)
+{
+    struct icon_view_probe_t *probe = (struct icon_view_probe_t*)data;
+    if (g_atomic_int_get (probe->generation) == probe->expected_generation) {
+        for (int i=0; i<probe->num_images; i++) {
+            struct icon_image_t *img = probe->images[i];
+            if (img->surface == NULL && !img->load_failed) {
+                img->file_size = probe->sizes[i].file_size;
+                if (probe->sizes[i].ok) {
+                    img->width = probe->sizes[i].width;
+                    img->height = probe->sizes[i].height;
+                    icon_image_size_changed (img);
+                }
+            }
         }
+    }
 
-        GtkWidget *hitbox = gtk_event_box_new ();
-        g_signal_connect (G_OBJECT(hitbox), "button-press-event", G_CALLBACK(on_image_clicked), img);
+    for (int i=0; i<probe->num_images; i++) {
+        free (probe->paths[i]);
+    }
+    free (probe->paths);
+    free (probe->images);
+    free (probe->sizes);
+    free (probe);
+    return G_SOURCE_REMOVE;
+}
 
-        // Setup DnD of images
-        {
-            gtk_drag_source_set (hitbox, GDK_BUTTON1_MASK, NULL, 0, GDK_ACTION_COPY);
-            gtk_drag_source_add_uri_targets (hitbox);
-            GdkPixbuf *pixbuf = gtk_image_get_pixbuf (GTK_IMAGE(img->image));
-            gtk_drag_source_set_icon_pixbuf (hitbox, pixbuf);
-            g_signal_connect (G_OBJECT(hitbox), "drag-data-get", G_CALLBACK(on_drag_data_get), img);
+// Runs in a worker thread.
+void icon_view_probe_run (gpointer data, gpointer user_data)
+{
+    struct icon_view_probe_t *probe = (struct icon_view_probe_t*)data;
+    for (int i=0; i<probe->num_images; i++) {
+        if (g_atomic_int_get (probe->generation) != probe->expected_generation) {
+            break;
         }
 
-        gtk_container_add (GTK_CONTAINER(hitbox), box);
+        probe->sizes[i].ok = image_probe (probe->paths[i], &probe->sizes[i].width,
+                                          &probe->sizes[i].height, &probe->sizes[i].file_size);
+    }
+
+    g_idle_add (icon_view_probe_done, probe);
+}
+
+// Read the sizes of the images of a scale and start decoding their files, if
+// that wasn't done already. Most of the time only the first scale is ever
+// looked at, so we don't pay for the others until they are needed.
+//
+// Nothing here touches the files, sizes are read in the background and the
+// layout is updated when they arrive. Probing is a lot cheaper than decoding,
+// so they usually arrive before the decoded images.
+void icon_view_realize_scale (struct icon_view_t *icon_view, int scale)
+{
+    struct icon_view_probe_t *probe = malloc (sizeof(struct icon_view_probe_t));
+    *probe = ZERO_INIT (struct icon_view_probe_t);
+    probe->generation = icon_view->generation;
+    probe->expected_generation = g_atomic_int_get (icon_view->generation);
+
+    int num_images = icon_view->images_len[scale-1];
+    probe->images = malloc (MAX(num_images, 1)*sizeof(struct icon_image_t*));
+    probe->paths = malloc (MAX(num_images, 1)*sizeof(char*));
+    probe->sizes = calloc (MAX(num_images, 1), sizeof(*probe->sizes));
+
+    for (struct icon_image_t *img = icon_view->images[scale-1]; img != NULL; img = img->next) {
+        if (img->realized) {
+            continue;
+        }
+
+        img->realized = true;
+        probe->images[probe->num_images] = img;
+        probe->paths[probe->num_images] = strdup (img->full_path);
+        probe->num_images++;
+
+        pixbuf_loader_request (&app.pixbuf_loader, img->full_path, -1, icon_view->generation,
+                               icon_image_loaded, img);
+    }
+
+    if (probe->num_images > 0) {
+        if (app.image_probe_pool == NULL) {
+            app.image_probe_pool = g_thread_pool_new (icon_view_probe_run, NULL, 1, FALSE, NULL);
+        }
+        g_thread_pool_push (app.image_probe_pool, probe, NULL);
+    } else {
+        icon_view_probe_done (probe);
+    }
+}
 
-        gtk_container_add (GTK_CONTAINER(all_icons), hitbox);
+// Free the surfaces of the images of icon_view, must be called before freeing
+// the pool where it was allocated.
+void icon_view_destroy_images (struct icon_view_t *icon_view)
+{
+    for (int i=0; i<ARRAY_SIZE(icon_view->images); i++) {
+        for (struct icon_image_t *img = icon_view->images[i]; img != NULL; img = img->next) {
+            if (img->surface != NULL) {
+                cairo_surface_destroy (img->surface);
+                img->surface = NULL;
+            }
+        }
+    }
+}
 
-        if(img->next == NULL) {
-            icon_view->selected_img = img;
-            set_icon_box_border (img);
-            last_img = img;
+GtkWidget* icon_view_create_icon_dpy (struct icon_view_t *icon_view, int scale)
+{
+    // Realize the next available scale too, the loader decodes requests in
+    // order so its images are decoded in the background after the ones we
+    // show.
+    icon_view_realize_scale (icon_view, scale);
+    for (int i=scale; i<ARRAY_SIZE(icon_view->images); i++) {
+        if (icon_view->images[i] != NULL) {
+            icon_view_realize_scale (icon_view, i+1);
+            break;
         }
-        img = img->next;
     }
 
-    // Place the icon list inside a GtkGrid so they are centered
+    icon_view->scale = scale;
+    icon_view->pressed_img = NULL;
+
+    struct icon_image_t *last_img = icon_view->images[scale-1];
+    while (last_img->next != NULL) {
+        last_img = last_img->next;
+    }
+    icon_view->selected_img = last_img;
+
+    GtkWidget *icon_area = gtk_drawing_area_new ();
+    icon_view->icon_area = icon_area;
+    gtk_widget_add_events (icon_area, GDK_BUTTON_PRESS_MASK);
+    g_signal_connect (G_OBJECT(icon_area), "draw", G_CALLBACK(icon_area_draw), icon_view);
+    g_signal_connect (G_OBJECT(icon_area), "destroy", G_CALLBACK(on_icon_area_destroy), icon_view);
+
+    // Setup DnD of images. The button press handler must be connected before
+    // the one of the drag source, so it can stop presses outside images.
+    g_signal_connect (G_OBJECT(icon_area), "button-press-event", G_CALLBACK(on_icon_area_button_press), icon_view);
+    gtk_drag_source_set (icon_area, GDK_BUTTON1_MASK, NULL, 0, GDK_ACTION_COPY);
+    gtk_drag_source_add_uri_targets (icon_area);
+    g_signal_connect (G_OBJECT(icon_area), "drag-begin", G_CALLBACK(on_icon_area_drag_begin), icon_view);
+    g_signal_connect (G_OBJECT(icon_area), "drag-data-get", G_CALLBACK(on_icon_area_drag_data_get), icon_view);
+
+    icon_view_layout (icon_view);
+
+    // Place the icon area inside a GtkGrid so it's centered
     GtkWidget *icon_dpy = spaced_grid_new (12);
     gtk_widget_set_valign (icon_dpy, GTK_ALIGN_CENTER);
     gtk_widget_set_halign (icon_dpy, GTK_ALIGN_CENTER);
     gtk_widget_set_hexpand (icon_dpy, TRUE);
     gtk_widget_set_vexpand (icon_dpy, TRUE);
-    gtk_grid_attach (GTK_GRID(icon_dpy), all_icons, 0, 0, 1, 1);
+    gtk_grid_attach (GTK_GRID(icon_dpy), icon_area, 0, 0, 1, 1);
 
     if (icon_view->image_data_dpy == NULL) {
         icon_view->image_data_dpy = image_data_dpy_new (last_img);
@@ -380,7 +729,7 @@ GtkWidget* draw_icon_view (struct icon_view_t *icon_view)
         GtkWidget *themes_combobox;
         theme_selector = labeled_combobox_new ("Theme:", &themes_combobox);
         for (struct icon_theme_t *curr_theme = app.themes; curr_theme; curr_theme = curr_theme->next) {
-            if (g_hash_table_contains (curr_theme->icon_names, icon_view->icon_name)) {
+            if (icon_theme_has_icon (curr_theme, icon_view->icon_name)) {
                 combo_box_text_append_text_with_id (GTK_COMBO_BOX_TEXT(themes_combobox), curr_theme->name);
             }
         }
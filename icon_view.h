@@ -3,7 +3,15 @@
  */
 
 struct icon_image_t {
-    GtkWidget *image;
+    // Files are decoded in the background the first time the scale of the
+    // image is shown, see icon_view_realize_scale(). Width and height are read
+    // from the file's header in the background too, usually before the file
+    // is decoded. They are 0 until then, or if the header couldn't be parsed.
+    // The surface is NULL until the file is decoded, it's destroyed by
+    // icon_view_destroy_images().
+    bool realized;
+    bool load_failed;
+    cairo_surface_t *surface;
     int width, height;
     char *label; // can be NULL
 
@@ -23,16 +31,20 @@ struct icon_image_t {
     struct icon_image_t *next;
     struct icon_view_t *view; // Pointer to the icon_view_t this icon_image_t is member of.
 
-    // UI Widgets
-    GtkWidget *box;
-    GtkCssProvider *custom_css;
+    // Area of the image and its label in the icon display, relative to the
+    // icon area. Computed by icon_view_layout().
+    GdkRectangle box;
 };
 
 #define IV_MAX_SCALE 3
 struct icon_view_t {
     char *icon_name;
 
-    int scale;
+    // Generation used for decoding the images, see pixbuf_loader.c. It must
+    // be incremented before freeing the icon view.
+    gint *generation;
+
+    int scale; // Scale being shown in the icon display
     struct icon_image_t *images[IV_MAX_SCALE];
     struct icon_image_t *images_end[IV_MAX_SCALE];
     int images_len[IV_MAX_SCALE];
@@ -42,6 +54,11 @@ struct icon_view_t {
     GtkWidget *image_data_dpy;
     struct icon_image_t *selected_img;
 
+    // Drawing area where all images of the shown scale are drawn. NULL if
+    // the icon view isn't being shown.
+    GtkWidget *icon_area;
+    struct icon_image_t *pressed_img; // Image where the last click happened, can be NULL
+
     GtkWidget *scrolled_window;
     GtkCssProvider *scrolled_window_custom_css;
 };
@@ -9,6 +9,12 @@
 #include "gtk_utils.c"
 #include "fk_paned.c"
 #include "fk_list_box.c"
+#include "dir_cache.c"
+#include "gtk_icon_cache.c"
+#include "name_table.c"
+#include "icon_search.c"
+#include "image_probe.c"
+#include "pixbuf_loader.c"
 
 struct app_t app;
 void app_set_selected_theme (struct app_t *app, const char *theme_name);
@@ -33,18 +39,125 @@ enum valid_extensions {
     NUM_EXTENSIONS
 };
 
+// Directory section of the index.theme file of a theme. Values not present in
+// the file are -1, except for scale and threshold which have their default
+// values of 1 and 2.
+struct theme_section_t {
+    char *name; // Relative to the theme directory, without a trailing '/'
+    int32_t size;
+    int32_t min_size;
+    int32_t max_size;
+    int32_t scale;
+    int32_t threshold;
+    char *type; // can be NULL
+    char *context; // can be NULL
+    bool is_scalable; // True if name contains "scalable"
+};
+
+// Place where a file for an icon was found inside a theme. The directory is
+// theme->dirs[base_dir] followed by theme->sections[section].name, the
+// file name is the icon name followed by app.valid_extensions[ext]. Unthemed
+// icons have no sections, for them the section is always 0 and the file is
+// directly inside the base directory.
+struct icon_location_t {
+    uint8_t base_dir;
+    uint8_t ext;
+    uint16_t section;
+};
+
+// A file or directory a theme was built from, with its modification time from
+// before the theme was scanned. See theme_cache.c.
+struct theme_dep_t {
+    char *path;
+    bool exists;
+    struct timespec mtime;
+};
+
+// Locations of an icon inside a theme, sorted by base_dir and then by section.
+struct icon_postings_t {
+    uint32_t num_locations;
+    struct icon_location_t *locations;
+};
+
+enum icon_facet_type_t {
+    ICON_FACET_CONTEXT,
+    ICON_FACET_SIZE,
+    ICON_FACET_SCALE,
+    ICON_FACET_TYPE,
+    NUM_ICON_FACET_TYPES
+};
+
+// Keys used for each facet type in search queries, like "context:Status".
+const char *icon_facet_type_names[NUM_ICON_FACET_TYPES] = {"context", "size", "scale", "type"};
+
+// A value of the Context, Size, Scale or Type keys of the sections of a theme,
+// together with the set of icons that have at least one file in a section
+// with that value. Bits are indexed by the position of the icon in
+// theme->sorted_icon_names.
+struct icon_facet_t {
+    enum icon_facet_type_t type;
+    char *value; // Sizes and scales are stored as decimal strings
+    uint64_t *bits;
+};
+
 struct icon_theme_t {
     mem_pool_t pool;
 
     char *name;
     uint32_t num_dirs;
     char **dirs;
+    // GTK's icon cache for each one of dirs, entries for directories without a
+    // valid cache are zero initialized. NULL for the theme of unthemed icons,
+    // and for themes restored from the theme cache.
+    struct gtk_icon_cache_t *icon_caches;
+    // Path and contents of the index.theme file, the contents are only read if
+    // the theme isn't restored from the theme cache. The theme of unthemed
+    // icons has neither, and its dir_name is NULL too.
+    char *index_fname;
     char *index_file;
     char *dir_name;
 
-    GHashTable *icon_names;
-
+    // Files and directories the theme was built from, see theme_cache.c.
+    uint32_t num_deps;
+    struct theme_dep_t *deps;
+
+    // Parsed contents of index_file, see theme_parse_index().
+    uint32_t num_inherits;
+    char **inherits;
+    uint32_t num_sections;
+    struct theme_section_t *sections;
+
+    // Set of ids in app.icon_name_table of the icons in this theme. For each
+    // one, icon_postings has the places where the icon can be found, indexed
+    // by its rank in icon_names. Locations of all icons are stored
+    // contiguously in locations.
+    struct name_set_t icon_names;
+    struct icon_postings_t *icon_postings;
+    // Names of all icons in the theme, sorted with str_cmp_callback().
+    char **sorted_icon_names;
+    struct icon_location_t *locations;
+
+    // Facet values found in the sections of the theme, see
+    // theme_facets_build(). Empty for the theme of unthemed icons.
+    uint32_t num_facets;
+    struct icon_facet_t *facets;
+
+    // Row of the All theme list that has each icon of sorted_icon_names, set
+    // by app_all_theme_list_update().
+    uint32_t *all_theme_rows;
+
+    // Scan jobs that will find the icon names of this theme. These are only
+    // valid while app_load_all_icon_themes() is running.
+    struct theme_scan_job_t *scan_jobs;
+    gint num_pending_scan_jobs;
+
+    // Next theme in app->themes, only set once the theme is fully loaded and
+    // added to the app by app_add_theme(). Before that, it links the themes in
+    // app->loaded_themes.
     struct icon_theme_t *next;
+
+    // Next theme in app->found_themes.
+    struct icon_theme_t *found_next;
 };
 
 enum theme_type_t {
@@ -63,34 +176,87 @@ struct app_t {
 
     GtkWidget *icon_list;
     GtkWidget *search_entry;
+    bool search_fuzzy;
     GtkWidget *icon_view_widget;
     GtkWidget *theme_selector;
 
+    // Names of the icons of all themes, themes refer to them by id.
+    struct name_table_t icon_name_table;
+
     // State if selected theme is THEME_TYPE_ALL
-    mem_pool_t all_icon_names_pool;
-    GTree *all_icon_names;
     GtkWidget *all_icon_names_widget;
     const char *all_icon_names_first;
     struct fk_list_box_t all_theme_fk_list_box;
+    struct icon_search_t all_theme_search;
+
+    // State if selected theme is THEME_TYPE_NORMAL. The same list is reused
+    // for all normal themes, its rows point into the sorted_icon_names array
+    // of the selected theme.
+    GtkWidget *normal_theme_widget;
+    struct fk_list_box_t normal_theme_fk_list_box;
+    struct icon_search_t normal_theme_search;
 
     // State if selected theme is THEME_TYPE_FOLDER
     mem_pool_t folder_theme_pool;
     char *folder_theme_dir;
     struct fk_list_box_t *folder_theme_fk_list_box;
+    struct icon_search_t folder_theme_search;
     GTree *folder_theme_icon_names;
     int folder_theme_inotify;
 
     // Linked list head for THEME_TYPE_NORMAL themes
     struct icon_theme_t *themes;
 
+    // All themes found by app_load_all_icon_themes(), even the ones that are
+    // still being scanned and aren't in themes yet. This list owns the themes.
+    struct icon_theme_t *found_themes;
+    GThread *load_thread;
+    // Set when closing the application, makes the loader thread and scan jobs
+    // stop early.
+    gint load_cancelled;
+
+    // Themes that finished loading but haven't been added to themes yet,
+    // linked by their next field. See app_theme_loaded_idle().
+    struct icon_theme_t *loaded_themes;
+    guint all_theme_update_timeout;
+
     // Icon view for the selected icon
     mem_pool_t icon_view_pool;
     struct icon_view_t icon_view;
 
+    // Images of icon views are decoded here. Generations of the icon view and
+    // of the icon views of the folder theme are incremented before they are
+    // freed. The prefetch generation is incremented when the selected row
+    // changes.
+    struct pixbuf_loader_t pixbuf_loader;
+    gint icon_view_generation;
+    gint folder_theme_generation;
+    gint prefetch_generation;
+
+    // Sizes of images are read from their files here, see
+    // icon_view_realize_scale(). Created the first time it's needed.
+    GThreadPool *image_probe_pool;
+
+    // Names of the rows around the selected one that are still to be
+    // prefetched, nearest first, allocated in prefetch_pool. See
+    // app_prefetch_neighbor_rows().
+    mem_pool_t prefetch_pool;
+    guint prefetch_idle;
+    enum theme_type_t prefetch_theme_type;
+    struct icon_theme_t *prefetch_theme;
+    char **prefetch_names;
+    int num_prefetch_names;
+    int next_prefetch_name;
+
+    // Listings of the directories read while loading the icon database
+    struct dir_cache_t dir_cache;
+
     const char* valid_extensions[NUM_EXTENSIONS];
 };
 
+bool icon_theme_has_icon (struct icon_theme_t *theme, const char *icon_name);
 #include "icon_view.c"
+#include "theme_cache.c"
 
 static inline
 char* consume_line (char *c)
@@ -229,18 +395,21 @@ bool is_end_of_section (char *c)
     return *c == '[' || *c == '\0';
 }
 
+// Returns the index in valid_extensions of the extension of fname, or -1 if it
+// doesn't have a valid one.
+//
 // NOTE: If multiple icons are found, ties are broken according to the order in
 // valid_extensions.
-bool fname_has_valid_extension (char *fname, size_t *icon_name_len)
+int fname_extension (char *fname, size_t *icon_name_len)
 {
-    bool ret = false;
+    int ext = -1;
     size_t len = strlen (fname);
     for (int i=0; i<ARRAY_SIZE(app.valid_extensions); i++) {
         if (g_str_has_suffix(fname, app.valid_extensions[i])) {
             if (icon_name_len != NULL) {
                 len -= strlen (app.valid_extensions[i]);
             }
-            ret = true;
+            ext = i;
             break;
         }
     }
@@ -248,103 +417,214 @@ bool fname_has_valid_extension (char *fname, size_t *icon_name_len)
     if (icon_name_len != NULL) {
         *icon_name_len = len;
     }
-    return ret;
+    return ext;
 }
 
-bool icon_lookup (mem_pool_t *pool, char *dir, const char *icon_name, char **found_file)
+bool fname_has_valid_extension (char *fname, size_t *icon_name_len)
 {
-    struct stat st;
-    if (stat(dir, &st) == -1 && errno == ENOENT) {
-        // NOTE: There are index.theme files that have entries for @2
-        // directories, even though such directories do not exist in the system.
-        //printf ("No directory named: %s\n", dir);
-        return false;
-    }
-
-    int ext_id = -1;
-    DIR *d = opendir (dir);
-    struct dirent *entry_info;
-    while (read_dir (d, &entry_info)) {
-        string_t icon_name_str = str_new(icon_name);
-        uint32_t icon_name_len = str_len(&icon_name_str);
+    return fname_extension (fname, icon_name_len) != -1;
+}
 
-        for (int i=0; i<ARRAY_SIZE(app.valid_extensions); i++) {
-            str_put_c (&icon_name_str, icon_name_len, app.valid_extensions[i]);
-            if (strcmp (str_data(&icon_name_str), entry_info->d_name) == 0) {
-                ext_id = i;
-            }
-        }
+// Compare a key returned by seek_next_key_value() with str.
+static inline
+bool is_key (char *key, uint32_t key_len, char *str)
+{
+    while (key_len > 0 && is_space (key + key_len - 1)) {
+        key_len--;
+    }
+    return strlen (str) == key_len && strncmp (str, key, key_len) == 0;
+}
 
-        str_free (&icon_name_str);
+// Copy a single value of a comma separated list into pool, spaces around it
+// and trailing '/' characters are removed. Returns NULL if the value is empty.
+char* theme_index_list_value_dup (mem_pool_t *pool, char *value, uint32_t value_len)
+{
+    while (value_len > 0 && is_space (value)) {
+        value++;
+        value_len--;
+    }
+    while (value_len > 0 && (is_space (value + value_len - 1) || value[value_len-1] == '/')) {
+        value_len--;
     }
-    closedir (d);
 
-    if (ext_id == -1) {
-        // Found no icon named icon_name
-        return false;
+    if (value_len == 0) {
+        return NULL;
     } else {
-        string_t found_path = str_new (dir);
-        if (str_last (&found_path) != '/') {
-            str_cat_c (&found_path, "/");
-        }
-        str_cat_c (&found_path, icon_name);
-        str_cat_c (&found_path, app.valid_extensions[ext_id]);
-
-        *found_file = mem_pool_push_size (pool, str_len(&found_path) + 1);
-        memcpy (*found_file, str_data(&found_path), str_len(&found_path) + 1);
-        str_free (&found_path);
-        return true;
+        return pom_strndup (pool, value, value_len);
     }
 }
 
-bool file_lookup (char *dir, char *file)
+// Split a comma separated list value into an array of strings allocated in pool.
+char** theme_index_list_parse (mem_pool_t *pool, char *value, uint32_t value_len, uint32_t *num_items)
 {
-    struct stat st;
-    if (stat(dir, &st) == -1 && errno == ENOENT) {
-        //printf ("No directory named: %s\n", dir);
-        return 0;
-    }
+    cont_buff_t items = {0};
+    char *end = value + value_len;
+    while (value < end) {
+        char *item_end = value;
+        while (item_end < end && *item_end != ',') {
+            item_end++;
+        }
 
-    bool res = false;
-    DIR *d = opendir (dir);
-    struct dirent *entry_info;
-    while (read_dir (d, &entry_info)) {
-        uint32_t file_len = strlen(file);
-        uint32_t entry_len = strlen(entry_info->d_name);
-        int cmp = strncmp (file, entry_info->d_name, MIN (file_len, entry_len));
-        if (cmp == 0) {
-            if (file_len == entry_len) {
-                res = true;
-                break;
-            }
+        char *item = theme_index_list_value_dup (pool, value, item_end - value);
+        if (item != NULL) {
+            char **new_item = cont_buff_push (&items, sizeof(char*));
+            *new_item = item;
         }
+        value = item_end + 1;
     }
-    closedir (d);
+
+    *num_items = items.used/sizeof(char*);
+    char **res = pom_dup (pool, items.data, items.used);
+    cont_buff_destroy (&items);
     return res;
 }
 
-templ_sort_ll(icon_theme_sort, struct icon_theme_t, strcasecmp((*a)->name, (*b)->name) < 0)
-
-void set_theme_name (struct icon_theme_t *theme)
+// Parse the index.theme file of a theme into its name, the list of inherited
+// themes, and the array of directory sections.
+//
+// Sections are taken in the order of the Directories and ScaledDirectories keys
+// of [Icon Theme], directories not listed there are not part of the theme.
+// Some themes (Oxygen) have repeated directory sections while they are unique
+// in the Directories key, in that case only the first section is used. Themes
+// without a Directories key use all sections in the order they appear.
+void theme_parse_index (struct icon_theme_t *theme)
 {
+    mem_pool_t pool = {0};
     char *c = theme->index_file;
 
-    char *section_name;
-    uint32_t section_name_len;
-    c = seek_next_section (c, &section_name, &section_name_len);
+    char **directories = NULL;
+    uint32_t num_directories = 0;
+    char **scaled_directories = NULL;
+    uint32_t num_scaled_directories = 0;
+    bool has_directories_key = false;
 
-    char *name_str = "Name";
+    // [Icon Theme]
+    c = seek_next_section (c, NULL, NULL);
     while ((c = consume_ignored_lines (c)) && *c && !is_end_of_section(c)) {
         char *key, *value;
         uint32_t key_len, value_len;
         c = seek_next_key_value (c, &key, &key_len, &value, &value_len);
-        if (strlen (name_str) == key_len && strncmp (name_str, key, key_len) == 0) {
-            theme->name = pom_push_size (&theme->pool, value_len+1);
-            memcpy (theme->name, value, value_len);
-            theme->name[value_len] = '\0';
+        if (is_key (key, key_len, "Name")) {
+            theme->name = pom_strndup (&theme->pool, value, value_len);
+
+        } else if (is_key (key, key_len, "Directories")) {
+            directories = theme_index_list_parse (&pool, value, value_len, &num_directories);
+            has_directories_key = true;
+
+        } else if (is_key (key, key_len, "ScaledDirectories")) {
+            scaled_directories =
+                theme_index_list_parse (&pool, value, value_len, &num_scaled_directories);
+            has_directories_key = true;
+
+        } else if (is_key (key, key_len, "Inherits")) {
+            theme->inherits =
+                theme_index_list_parse (&theme->pool, value, value_len, &theme->num_inherits);
+        }
+    }
+
+    // Parse all directory sections, and index them by name.
+    GHashTable *sections_by_name = g_hash_table_new (g_str_hash, g_str_equal);
+    cont_buff_t sections_in_file = {0};
+    while (*c) {
+        char *section_name = NULL;
+        uint32_t section_name_len = 0;
+        c = seek_next_section (c, &section_name, &section_name_len);
+        if (section_name == NULL) {
+            // NOTE: End of file or syntax error.
+            continue;
+        }
+
+        struct theme_section_t section = ZERO_INIT (struct theme_section_t);
+        section.name = theme_index_list_value_dup (&theme->pool, section_name, section_name_len);
+        section.size = -1;
+        section.min_size = -1;
+        section.max_size = -1;
+        section.scale = 1;
+        section.threshold = 2;
+
+        while ((c = consume_ignored_lines (c)) && !is_end_of_section(c)) {
+            char *key, *value;
+            uint32_t key_len, value_len;
+            c = seek_next_key_value (c, &key, &key_len, &value, &value_len);
+            if (is_key (key, key_len, "Size")) {
+                sscanf (value, "%"SCNi32, &section.size);
+
+            } else if (is_key (key, key_len, "MinSize")) {
+                sscanf (value, "%"SCNi32, &section.min_size);
+
+            } else if (is_key (key, key_len, "MaxSize")) {
+                sscanf (value, "%"SCNi32, &section.max_size);
+
+            } else if (is_key (key, key_len, "Scale")) {
+                sscanf (value, "%"SCNi32, &section.scale);
+
+            } else if (is_key (key, key_len, "Threshold")) {
+                sscanf (value, "%"SCNi32, &section.threshold);
+
+            } else if (is_key (key, key_len, "Type")) {
+                section.type = pom_strndup (&theme->pool, value, value_len);
+
+            } else if (is_key (key, key_len, "Context")) {
+                section.context = pom_strndup (&theme->pool, value, value_len);
+            }
         }
 
+        // NOTE: We say an image is scalable if dir contains the substring
+        // "scalable" as this is what developers seem to use. The index file
+        // may disagree, and Gtk for example makes any .svg icon 'scalable' no
+        // matter what the index file or dir says.
+        section.is_scalable = section.name != NULL && strstr (section.name, "scalable") != NULL;
+
+        if (section.name != NULL && !g_hash_table_contains (sections_by_name, section.name)) {
+            struct theme_section_t *new_section = pom_dup (&pool, &section, sizeof(section));
+            g_hash_table_insert (sections_by_name, new_section->name, new_section);
+
+            struct theme_section_t **in_file = cont_buff_push (&sections_in_file, sizeof(void*));
+            *in_file = new_section;
+        }
+    }
+
+    // Build the final array of sections.
+    cont_buff_t sections = {0};
+    if (has_directories_key) {
+        GHashTable *used = g_hash_table_new (g_str_hash, g_str_equal);
+        for (int i=0; i<num_directories + num_scaled_directories; i++) {
+            char *dir_name = i < num_directories ?
+                directories[i] : scaled_directories[i - num_directories];
+
+            struct theme_section_t *section = g_hash_table_lookup (sections_by_name, dir_name);
+            if (section != NULL && !g_hash_table_contains (used, dir_name)) {
+                g_hash_table_insert (used, dir_name, NULL);
+
+                struct theme_section_t *new_section = cont_buff_push (&sections, sizeof(*section));
+                *new_section = *section;
+            }
+        }
+        g_hash_table_destroy (used);
+
+    } else {
+        struct theme_section_t **in_file = sections_in_file.data;
+        for (int i=0; i<sections_in_file.used/sizeof(void*); i++) {
+            struct theme_section_t *new_section = cont_buff_push (&sections, sizeof(*in_file[i]));
+            *new_section = *in_file[i];
+        }
+    }
+
+    theme->num_sections = sections.used/sizeof(struct theme_section_t);
+    theme->sections = pom_dup (&theme->pool, sections.data, sections.used);
+
+    // Locations store section indices in 16 bits, ignore the sections that
+    // don't fit.
+    if (theme->num_sections > UINT16_MAX + 1) {
+        printf ("Theme '%s' has %"PRIu32" directories, only the first %d are used.\n",
+                theme->dir_name, theme->num_sections, UINT16_MAX + 1);
+        theme->num_sections = UINT16_MAX + 1;
     }
+
+    cont_buff_destroy (&sections);
+    cont_buff_destroy (&sections_in_file);
+    g_hash_table_destroy (sections_by_name);
+    mem_pool_destroy (&pool);
 }
 
 struct icon_theme_t* app_icon_theme_new (struct app_t *app)
@@ -354,18 +634,163 @@ struct icon_theme_t* app_icon_theme_new (struct app_t *app)
     *new_icon_theme = ZERO_INIT (struct icon_theme_t);
     new_icon_theme->pool = bootstrap;
 
-    new_icon_theme->next = app->themes;
-    app->themes = new_icon_theme;
+    new_icon_theme->found_next = app->found_themes;
+    app->found_themes = new_icon_theme;
     return new_icon_theme;
 }
 
 void icon_theme_destroy (struct icon_theme_t *icon_theme)
 {
-    if (icon_theme->icon_names != NULL)
-        g_hash_table_destroy (icon_theme->icon_names);
+    if (icon_theme->icon_caches != NULL) {
+        for (int i=0; i<icon_theme->num_dirs; i++) {
+            gtk_icon_cache_close (&icon_theme->icon_caches[i]);
+        }
+    }
+    free (icon_theme->all_theme_rows);
     mem_pool_destroy (&icon_theme->pool);
 }
 
+// If defined, icon names of all themes are found by a pool of worker threads.
+// Otherwise scan jobs are run one after the other in the main thread.
+#define THEME_SCAN_PARALLEL
+
+// Themes with more directory sections than this are split into several scan
+// jobs, so a single huge theme does not end up being scanned by a single
+// thread while all others are idle.
+#define THEME_SCAN_SECTIONS_PER_JOB 64
+
+// If defined, the main window is shown before loading icon themes. Themes are
+// loaded by a background thread and added to the UI one by one as soon as each
+// one is scanned. Otherwise the application starts after all themes have been
+// loaded.
+#define APP_LOAD_ASYNC
+
+void theme_scan_finish (struct icon_theme_t *theme);
+
+// A scan job finds the icons inside a range of the directory sections of a
+// theme, across all the directories the theme is spread across. Jobs don't
+// share any mutable state with each other, everything found is stored in the
+// job and then merged into the theme by theme_scan_jobs_merge().
+//
+// Directories with a valid GTK icon cache are not listed by these jobs.
+// Instead, each cache gets a job of its own that walks it once and assigns
+// its entries to sections by their directory index.
+struct theme_scan_job_t {
+    struct icon_theme_t *theme;
+
+    // Range of theme->sections scanned by this job. The theme of unthemed
+    // icons has no sections, in which case icons are looked for directly
+    // inside the theme's dirs.
+    int first_section;
+    int num_sections;
+
+    // Index into theme->dirs of the directory whose icon cache is read by
+    // this job, or -1 if the job lists directories.
+    int cache_dir;
+
+    // Array of the names of the icons found by the job, each one is stored
+    // only once in pool. name_idx maps names to their index plus 1, and after
+    // interning them name_ids has their id in app.icon_name_table.
+    mem_pool_t pool;
+    cont_buff_t names;
+    GHashTable *name_idx;
+    uint32_t *name_ids;
+
+    // Array of struct theme_scan_hit_t, one for each icon file found.
+    cont_buff_t hits;
+
+    struct theme_scan_job_t *next;
+};
+
+struct theme_scan_hit_t {
+    uint32_t name; // Index into the job's names
+    struct icon_location_t location;
+};
+
+void theme_scan_job_add_hit (struct theme_scan_job_t *job, char *icon_name, size_t icon_name_len,
+                             int base_dir, int section, int ext)
+{
+    char name[icon_name_len+1];
+    memcpy (name, icon_name, icon_name_len);
+    name[icon_name_len] = '\0';
+
+    uint32_t idx = GPOINTER_TO_UINT (g_hash_table_lookup (job->name_idx, name));
+    if (idx == 0) {
+        char **stored_name = cont_buff_push (&job->names, sizeof(char*));
+        *stored_name = pom_strndup (&job->pool, name, icon_name_len);
+        idx = job->names.used/sizeof(char*);
+        g_hash_table_insert (job->name_idx, *stored_name, GUINT_TO_POINTER (idx));
+    }
+
+    struct theme_scan_hit_t *hit = cont_buff_push (&job->hits, sizeof(struct theme_scan_hit_t));
+    hit->name = idx - 1;
+    hit->location.base_dir = base_dir;
+    hit->location.section = section;
+    hit->location.ext = ext;
+}
+
+// Add a hit into job for each icon file found directly inside the directory at
+// path.
+void icon_dir_scan (struct theme_scan_job_t *job, char *path, int base_dir, int section)
+{
+    struct dir_listing_t listing;
+    if (!dir_cache_list (&app.dir_cache, path, &listing)) {
+        // NOTE: There are index.theme files that have entries for directories
+        // that don't exist in the system.
+        return;
+    }
+
+    for (int i=0; i<listing.num_entries; i++) {
+        char *fname = dir_listing_name (&listing, i);
+
+        size_t icon_name_len;
+        int ext;
+        if (listing.entries[i].type == DIR_ENTRY_FILE && fname[0] != '.' &&
+            (ext = fname_extension (fname, &icon_name_len)) != -1) {
+            theme_scan_job_add_hit (job, fname, icon_name_len, base_dir, section, ext);
+        }
+    }
+}
+
+// Add a hit into job for each icon file in cache that is inside one of the
+// directories being scanned. The section index of each directory is stored in
+// dir_sections, which is indexed by the cache's directory index and has -1 for
+// directories not being scanned.
+void icon_cache_scan (struct theme_scan_job_t *job, struct gtk_icon_cache_t *cache,
+                      int base_dir, int *dir_sections)
+{
+    string_t fname = {0};
+
+    struct gtk_icon_cache_iter_t it = {0};
+    while (gtk_icon_cache_next_icon (cache, &it)) {
+        for (uint32_t i=0; i<it.n_images; i++) {
+            uint16_t dir_idx, flags;
+            if (!gtk_icon_cache_icon_image (cache, &it, i, &dir_idx, &flags) ||
+                dir_idx >= cache->n_dirs || dir_sections[dir_idx] == -1) {
+                continue;
+            }
+
+            // Go through the file names this icon has, and get the icon name
+            // from them the same way we do when listing directories.
+            for (int j=0; j<ARRAY_SIZE(gtk_icon_cache_suffixes); j++) {
+                if (flags & gtk_icon_cache_suffixes[j].flag) {
+                    str_set (&fname, it.name);
+                    str_cat_c (&fname, gtk_icon_cache_suffixes[j].suffix);
+
+                    size_t icon_name_len;
+                    int ext = fname_extension (str_data(&fname), &icon_name_len);
+                    if (ext != -1) {
+                        theme_scan_job_add_hit (job, str_data(&fname), icon_name_len,
+                                                base_dir, dir_sections[dir_idx], ext);
+                    }
+                }
+            }
+        }
+    }
+
+    str_free (&fname);
+}
+
 // I have to find this information directly from the icon directories and
 // index.theme files. The alternative of using GtkIconTheme with a custom theme
 // and then calling gtk_icon_theme_list_icons() on it does not only return icons
@@ -379,86 +804,131 @@ void icon_theme_destroy (struct icon_theme_t *icon_theme)
 // I expected Hicolor icons to be there because it's the fallback theme, but I
 // didn't expect any of the rest. All this is probably done for backward
 // compatibility reasons but it does not work for what we want.
-void set_theme_icon_names (struct icon_theme_t *theme)
-{
-  theme->icon_names = g_hash_table_new (g_str_hash, g_str_equal);
-
-  if (theme->dir_name != NULL) {
-      int i;
-      for (i=0; i<theme->num_dirs; i++) {
-          char *c = theme->index_file;
-
-          // Ignore the first section: [Icon Theme]
-          c = seek_next_section (c, NULL, NULL);
-          c = consume_section (c);
-
-          string_t theme_dir = str_new (theme->dirs[i]);
-          str_cat_c (&theme_dir, "/");
-          uint32_t theme_dir_len = str_len (&theme_dir);
-          while ((c = consume_section (c)) && *c) {
-              char *section_name;
-              uint32_t section_name_len;
-              c = seek_next_section (c, &section_name, &section_name_len);
-              string_t curr_dir = strn_new (section_name, section_name_len);
-              str_put (&theme_dir, theme_dir_len, &curr_dir);
-              if (section_name[section_name_len-1] != '/') {
-                  str_cat_c (&theme_dir, "/");
-              }
-              uint32_t curr_dir_len = str_len (&theme_dir);
-
-              struct stat st;
-              if (stat(str_data(&theme_dir), &st) == -1 && errno == ENOENT) {
-                  continue;
-              }
-
-              DIR *d = opendir (str_data(&theme_dir));
-              struct dirent *entry_info;
-              while (read_dir (d, &entry_info)) {
-                  if (entry_info->d_name[0] != '.') {
-                      str_put_c (&theme_dir, curr_dir_len, entry_info->d_name);
-                      size_t icon_name_len;
-                      if (stat(str_data(&theme_dir), &st) == 0 &&
-                          S_ISREG(st.st_mode) &&
-                          fname_has_valid_extension (entry_info->d_name, &icon_name_len)) {
-                          char *icon_name = pom_strndup (&theme->pool, entry_info->d_name, icon_name_len);
-                          g_hash_table_insert (theme->icon_names, icon_name, NULL);
-                      }
-                  }
-              }
-              closedir (d);
-          }
-      }
-
-  } else {
-      // This is the case for non themed icons.
-      int i;
-      for (i=0; i<theme->num_dirs; i++) {
-        string_t path_str = str_new (theme->dirs[i]);
-        if (str_last(&path_str) != '/') {
-            str_cat_c (&path_str, "/");
+//
+// NOTE: This runs from worker threads when THEME_SCAN_PARALLEL is defined. It
+// must only read the theme, everything is written into the job.
+void theme_scan_job_run (gpointer data, gpointer user_data)
+{
+    struct theme_scan_job_t *job = (struct theme_scan_job_t*)data;
+    struct icon_theme_t *theme = job->theme;
+
+    if (g_atomic_int_get (&app.load_cancelled)) {
+        // The job is still finished so the theme gets merged and all jobs
+        // are destroyed, there's just nothing in it.
+
+    } else if (job->cache_dir != -1) {
+        // GTK's icon cache is up to date, get icons from there instead of
+        // listing directories.
+        struct gtk_icon_cache_t *cache = &theme->icon_caches[job->cache_dir];
+        int *dir_sections = malloc (MAX(cache->n_dirs, 1)*sizeof(int));
+        for (int j=0; j<cache->n_dirs; j++) {
+            dir_sections[j] = -1;
         }
-        uint32_t path_len = str_len (&path_str);
 
-        DIR *d = opendir (str_data(&path_str));
-        struct dirent *entry_info;
-        while (read_dir (d, &entry_info)) {
-            struct stat st;
-            str_put_c (&path_str, path_len, entry_info->d_name);
-
-            if (stat(str_data(&path_str), &st) == 0 && S_ISREG(st.st_mode)) {
-                size_t icon_name_len;
-                if (fname_has_valid_extension(entry_info->d_name, &icon_name_len)) {
-                    char *icon_name = pom_strndup (&theme->pool, entry_info->d_name, icon_name_len);
-                    g_hash_table_insert (theme->icon_names, icon_name, NULL);
+        for (int j=job->first_section; j<job->first_section+job->num_sections; j++) {
+            char *section_name = theme->sections[j].name;
+            int dir_idx = gtk_icon_cache_dir_idx (cache, section_name, strlen (section_name));
+            if (dir_idx != -1 && dir_sections[dir_idx] == -1) {
+                dir_sections[dir_idx] = j;
+            }
+        }
+
+        icon_cache_scan (job, cache, job->cache_dir, dir_sections);
+        free (dir_sections);
+
+    } else {
+        for (int i=0; i<theme->num_dirs; i++) {
+            string_t path_str = str_new (theme->dirs[i]);
+            if (str_last(&path_str) != '/') {
+                str_cat_c (&path_str, "/");
+            }
+            uint32_t path_len = str_len (&path_str);
+
+            if (theme->dir_name == NULL) {
+                // This is the case for non themed icons.
+                icon_dir_scan (job, str_data(&path_str), i, 0);
+
+            } else if (!gtk_icon_cache_is_valid (&theme->icon_caches[i])) {
+                for (int j=job->first_section;
+                     j<job->first_section+job->num_sections && !g_atomic_int_get (&app.load_cancelled);
+                     j++) {
+                    str_put_c (&path_str, path_len, theme->sections[j].name);
+                    str_cat_c (&path_str, "/");
+
+                    icon_dir_scan (job, str_data(&path_str), i, j);
                 }
             }
+
+            str_free (&path_str);
         }
-        str_free (&path_str);
-        closedir (d);
-      }
-  }
+    }
+
+    // The last job of a theme to finish, merges the results of all of them.
+    if (g_atomic_int_dec_and_test (&theme->num_pending_scan_jobs)) {
+        theme_scan_finish (theme);
+    }
+}
+
+struct theme_scan_job_t* theme_scan_job_new (struct icon_theme_t *theme,
+                                             int first_section, int num_sections, int cache_dir)
+{
+    struct theme_scan_job_t *job = pom_push_struct (&theme->pool, struct theme_scan_job_t);
+    *job = ZERO_INIT (struct theme_scan_job_t);
+    job->theme = theme;
+    job->first_section = first_section;
+    job->num_sections = num_sections;
+    job->cache_dir = cache_dir;
+    job->name_idx = g_hash_table_new (g_str_hash, g_str_equal);
+
+    job->next = theme->scan_jobs;
+    theme->scan_jobs = job;
+    theme->num_pending_scan_jobs++;
+    return job;
+}
+
+// Split the icon lookup of a theme into scan jobs. There is one job for each
+// directory with a valid icon cache, and the rest of the directories are
+// listed by jobs that take at most THEME_SCAN_SECTIONS_PER_JOB directory
+// sections from the index file.
+void theme_scan_jobs_create (struct icon_theme_t *theme)
+{
+    if (theme->dir_name == NULL) {
+        theme_scan_job_new (theme, 0, 0, -1);
+        return;
+    }
+
+    bool has_uncached_dirs = false;
+    for (int i=0; i<theme->num_dirs; i++) {
+        if (gtk_icon_cache_is_valid (&theme->icon_caches[i])) {
+            if (theme->num_sections > 0) {
+                theme_scan_job_new (theme, 0, theme->num_sections, i);
+            }
+        } else {
+            has_uncached_dirs = true;
+        }
+    }
+
+    if (has_uncached_dirs) {
+        for (int i=0; i<theme->num_sections; i+=THEME_SCAN_SECTIONS_PER_JOB) {
+            theme_scan_job_new (theme, i, MIN (THEME_SCAN_SECTIONS_PER_JOB, theme->num_sections - i), -1);
+        }
+    }
+}
+
+static inline
+bool icon_location_lt (struct icon_location_t *a, struct icon_location_t *b)
+{
+    if (a->base_dir != b->base_dir) {
+        return a->base_dir < b->base_dir;
+    } else if (a->section != b->section) {
+        return a->section < b->section;
+    } else {
+        return a->ext < b->ext;
+    }
 }
 
+templ_sort(icon_location_sort, struct icon_location_t, icon_location_lt (a, b))
+
 gint strcase_cmp_callback (gconstpointer a, gconstpointer b)
 {
     return g_ascii_strcasecmp ((const char*)a, (const char*)b);
@@ -476,17 +946,304 @@ gint str_cmp_callback (gconstpointer a, gconstpointer b)
     }
 }
 
-void app_load_all_icon_themes (struct app_t *app)
+struct icon_name_rank_t {
+    char *name;
+    uint32_t rank;
+};
+templ_sort(icon_name_rank_sort, struct icon_name_rank_t, str_cmp_callback (a->name, b->name) < 0)
+
+// Finds the facet of type with value, or NULL if no section of theme has it.
+// Values are compared ignoring case.
+struct icon_facet_t* icon_theme_get_facet (struct icon_theme_t *theme,
+                                           enum icon_facet_type_t type, const char *value)
 {
-    GtkIconTheme *icon_theme = gtk_icon_theme_get_default ();
-    gchar **path;
-    gint num_paths;
-    gtk_icon_theme_get_search_path (icon_theme, &path, &num_paths);
+    for (uint32_t i=0; i<theme->num_facets; i++) {
+        if (theme->facets[i].type == type && g_ascii_strcasecmp (theme->facets[i].value, value) == 0) {
+            return &theme->facets[i];
+        }
+    }
+    return NULL;
+}
+
+// Create a facet for each distinct Context, Size, Scale and Type in the
+// sections of theme, and set the bits of all icons that have a location in
+// each one. positions maps the rank of each icon in theme->icon_names to its
+// position in theme->sorted_icon_names.
+//
+// Sections without a Type key get "Threshold", which is the default in the
+// icon theme specification.
+void theme_facets_build (struct icon_theme_t *theme, uint32_t *positions)
+{
+    if (theme->num_sections == 0) {
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    cont_buff_t facets = {0};
+
+    // Index into facets of the value of each facet type for each section, or
+    // -1 if the section doesn't have it.
+    int32_t *section_facets =
+        pom_push_array (&pool, theme->num_sections*NUM_ICON_FACET_TYPES, int32_t);
+    for (uint32_t i=0; i<theme->num_sections; i++) {
+        struct theme_section_t *section = &theme->sections[i];
+
+        char size[16], scale[16];
+        snprintf (size, ARRAY_SIZE(size), "%"PRIi32, section->size);
+        snprintf (scale, ARRAY_SIZE(scale), "%"PRIi32, section->scale);
+
+        const char *values[NUM_ICON_FACET_TYPES];
+        values[ICON_FACET_CONTEXT] = section->context;
+        values[ICON_FACET_SIZE] = section->size != -1 ? size : NULL;
+        values[ICON_FACET_SCALE] = scale;
+        values[ICON_FACET_TYPE] = section->type != NULL ? section->type : "Threshold";
+
+        for (int type=0; type<NUM_ICON_FACET_TYPES; type++) {
+            int32_t *facet_idx = &section_facets[i*NUM_ICON_FACET_TYPES + type];
+            *facet_idx = -1;
+            if (values[type] == NULL) continue;
+
+            struct icon_facet_t *existing = facets.data;
+            uint32_t num_existing = facets.used/sizeof(struct icon_facet_t);
+            for (uint32_t j=0; j<num_existing; j++) {
+                if (existing[j].type == type && g_ascii_strcasecmp (existing[j].value, values[type]) == 0) {
+                    *facet_idx = j;
+                    break;
+                }
+            }
+
+            if (*facet_idx == -1) {
+                struct icon_facet_t *new_facet = cont_buff_push (&facets, sizeof(struct icon_facet_t));
+                new_facet->type = type;
+                new_facet->value = pom_strdup (&theme->pool, values[type]);
+                *facet_idx = num_existing;
+            }
+        }
+    }
+
+    // NOTE: Scale and Type always have a value, so there is at least one facet.
+    theme->num_facets = facets.used/sizeof(struct icon_facet_t);
+    theme->facets = pom_dup (&theme->pool, facets.data, facets.used);
+
+    uint32_t num_words = (theme->icon_names.count + 63)/64;
+    for (uint32_t i=0; i<theme->num_facets; i++) {
+        theme->facets[i].bits = pom_push_array (&theme->pool, MAX(num_words, 1), uint64_t);
+        memset (theme->facets[i].bits, 0, MAX(num_words, 1)*sizeof(uint64_t));
+    }
+
+    for (uint32_t rank=0; rank<theme->icon_names.count; rank++) {
+        uint32_t pos = positions[rank];
+        struct icon_postings_t *postings = &theme->icon_postings[rank];
+        for (uint32_t j=0; j<postings->num_locations; j++) {
+            int32_t *facet_idx = &section_facets[postings->locations[j].section*NUM_ICON_FACET_TYPES];
+            for (int type=0; type<NUM_ICON_FACET_TYPES; type++) {
+                if (facet_idx[type] != -1) {
+                    theme->facets[facet_idx[type]].bits[pos/64] |= (uint64_t)1 << (pos%64);
+                }
+            }
+        }
+    }
+
+    cont_buff_destroy (&facets);
+    mem_pool_destroy (&pool);
+}
+
+// Build the icon set and postings of a theme from the hits found by all its
+// scan jobs, and destroy the jobs.
+//
+// Names found by each job are interned into app.icon_name_table, then the
+// locations of each icon are counted, and finally stored, this way the
+// locations of all icons end up in a single array.
+void theme_scan_jobs_merge (struct icon_theme_t *theme)
+{
+    mem_pool_t pool = {0};
+
+    // Map the names of each job to their global ids.
+    uint32_t max_id = 0;
+    for (struct theme_scan_job_t *job = theme->scan_jobs; job; job = job->next) {
+        uint32_t num_names = job->names.used/sizeof(char*);
+        job->name_ids = pom_push_array (&pool, MAX(num_names, 1), uint32_t);
+        name_table_intern (&app.icon_name_table, job->names.data, num_names, job->name_ids);
+
+        for (uint32_t i=0; i<num_names; i++) {
+            max_id = MAX (max_id, job->name_ids[i] + 1);
+        }
+    }
+
+    name_set_init (&theme->pool, &theme->icon_names, max_id);
+    for (struct theme_scan_job_t *job = theme->scan_jobs; job; job = job->next) {
+        uint32_t num_names = job->names.used/sizeof(char*);
+        for (uint32_t i=0; i<num_names; i++) {
+            name_set_add (&theme->icon_names, job->name_ids[i]);
+        }
+    }
+    name_set_compute_rank (&theme->icon_names);
+
+    // Names are sorted together with their rank, so we know the position of
+    // each icon in sorted_icon_names when building facets.
+    theme->sorted_icon_names = pom_push_array (&theme->pool, MAX(theme->icon_names.count, 1), char*);
+    uint32_t *positions = pom_push_array (&pool, MAX(theme->icon_names.count, 1), uint32_t);
+    {
+        struct icon_name_rank_t *names =
+            pom_push_array (&pool, MAX(theme->icon_names.count, 1), struct icon_name_rank_t);
+
+        uint32_t i = 0;
+        int64_t id = -1;
+        while ((id = name_set_next (&theme->icon_names, id)) != -1) {
+            names[i].name = name_table_get (&app.icon_name_table, id);
+            names[i].rank = i;
+            i++;
+        }
+        icon_name_rank_sort (names, theme->icon_names.count);
+
+        for (i=0; i<theme->icon_names.count; i++) {
+            theme->sorted_icon_names[i] = names[i].name;
+            positions[names[i].rank] = i;
+        }
+    }
+
+    theme->icon_postings =
+        pom_push_array (&theme->pool, MAX(theme->icon_names.count, 1), struct icon_postings_t);
+    memset (theme->icon_postings, 0, MAX(theme->icon_names.count, 1)*sizeof(struct icon_postings_t));
+
+    uint32_t num_locations = 0;
+    for (struct theme_scan_job_t *job = theme->scan_jobs; job; job = job->next) {
+        struct theme_scan_hit_t *hits = job->hits.data;
+        uint32_t num_hits = job->hits.used/sizeof(struct theme_scan_hit_t);
+        for (uint32_t i=0; i<num_hits; i++) {
+            uint32_t rank = name_set_rank (&theme->icon_names, job->name_ids[hits[i].name]);
+            theme->icon_postings[rank].num_locations++;
+            num_locations++;
+        }
+    }
+
+    theme->locations = pom_push_array (&theme->pool, MAX(num_locations, 1), struct icon_location_t);
+    struct icon_location_t *next_location = theme->locations;
+    for (uint32_t i=0; i<theme->icon_names.count; i++) {
+        struct icon_postings_t *postings = &theme->icon_postings[i];
+        postings->locations = next_location;
+        next_location += postings->num_locations;
+        postings->num_locations = 0;
+    }
+
+    struct theme_scan_job_t *job = theme->scan_jobs;
+    while (job != NULL) {
+        struct theme_scan_hit_t *hits = job->hits.data;
+        uint32_t num_hits = job->hits.used/sizeof(struct theme_scan_hit_t);
+        for (uint32_t i=0; i<num_hits; i++) {
+            uint32_t rank = name_set_rank (&theme->icon_names, job->name_ids[hits[i].name]);
+            struct icon_postings_t *postings = &theme->icon_postings[rank];
+            postings->locations[postings->num_locations++] = hits[i].location;
+        }
+
+        cont_buff_destroy (&job->hits);
+        cont_buff_destroy (&job->names);
+        g_hash_table_destroy (job->name_idx);
+        mem_pool_destroy (&job->pool);
+        job = job->next;
+    }
+    theme->scan_jobs = NULL;
+
+    // Sort locations and if an icon has more than one file in the same
+    // directory keep only the one with the highest priority extension.
+    for (uint32_t i=0; i<theme->icon_names.count; i++) {
+        struct icon_postings_t *postings = &theme->icon_postings[i];
+        icon_location_sort (postings->locations, postings->num_locations);
+
+        uint32_t num_unique = 0;
+        for (uint32_t j=0; j<postings->num_locations; j++) {
+            struct icon_location_t *loc = &postings->locations[j];
+            if (num_unique == 0 ||
+                postings->locations[num_unique-1].base_dir != loc->base_dir ||
+                postings->locations[num_unique-1].section != loc->section) {
+                postings->locations[num_unique++] = *loc;
+            }
+        }
+        postings->num_locations = num_unique;
+    }
+
+    theme_facets_build (theme, positions);
+    mem_pool_destroy (&pool);
+}
+
+// Returns true if theme has an icon called icon_name.
+bool icon_theme_has_icon (struct icon_theme_t *theme, const char *icon_name)
+{
+    uint32_t id;
+    return name_table_lookup (&app.icon_name_table, icon_name, &id) &&
+           name_set_contains (&theme->icon_names, id);
+}
+
+// Returns the locations of the icon called icon_name in theme, or NULL if the
+// theme doesn't have it.
+struct icon_postings_t* icon_theme_get_postings (struct icon_theme_t *theme, const char *icon_name)
+{
+    uint32_t id;
+    if (name_table_lookup (&app.icon_name_table, icon_name, &id) &&
+        name_set_contains (&theme->icon_names, id)) {
+        return &theme->icon_postings[name_set_rank (&theme->icon_names, id)];
+    } else {
+        return NULL;
+    }
+}
+
+gboolean app_theme_loaded_idle (gpointer data);
+
+// Called once all tables of a theme are built, maybe from a worker thread.
+void theme_load_finish (struct icon_theme_t *theme)
+{
+#ifdef APP_LOAD_ASYNC
+    if (!g_atomic_int_get (&app.load_cancelled)) {
+        g_idle_add (app_theme_loaded_idle, theme);
+    }
+#endif
+}
+
+// Called once all scan jobs of a theme have finished, maybe from a worker
+// thread.
+void theme_scan_finish (struct icon_theme_t *theme)
+{
+    theme_scan_jobs_merge (theme);
+    theme_load_finish (theme);
+}
+
+
+// Locations store base directory indices in 8 bits. Returns how many of the
+// num_dirs directories a theme is spread across can be used, the rest are
+// ignored.
+uint32_t theme_clamp_num_dirs (struct icon_theme_t *theme, uint32_t num_dirs)
+{
+    if (num_dirs > UINT8_MAX + 1) {
+        printf ("Theme '%s' is spread across %"PRIu32" directories, only the first %d are used.\n",
+                theme->dir_name != NULL ? theme->dir_name : "Unthemed", num_dirs, UINT8_MAX + 1);
+        num_dirs = UINT8_MAX + 1;
+    }
+    return num_dirs;
+}
+
+// Find all icon themes in the search paths path and scan them, themes that
+// didn't change since the last run are restored from the theme cache instead.
+// Every theme is passed to app_add_theme() as soon as it's loaded if
+// APP_LOAD_ASYNC is defined, otherwise it's up to the caller to add themes in
+// app->found_themes after this returns.
+//
+// NOTE: This doesn't touch any UI state, when APP_LOAD_ASYNC is defined it
+// runs in a background thread.
+void app_load_all_icon_themes (struct app_t *app, gchar **path, gint num_paths)
+{
+    char *cache_fname = g_build_filename (g_get_user_cache_dir(), "iconoscope", "dir_cache.bin", NULL);
+    dir_cache_init (&app->dir_cache, cache_fname);
+    g_free (cache_fname);
+
+    struct theme_cache_t theme_cache;
+    cache_fname = g_build_filename (g_get_user_cache_dir(), "iconoscope", "theme_cache.bin", NULL);
+    theme_cache_init (&theme_cache, cache_fname);
+    g_free (cache_fname);
 
     // Locate all index.theme files that are in the search paths, and append a
     // new icon_theme_t struct for each one.
     int i;
-    for (i=0; i<num_paths; i++) {
+    for (i=0; i<num_paths && !g_atomic_int_get (&app->load_cancelled); i++) {
         char *curr_search_path = path[i];
         string_t path_str = str_new (curr_search_path);
         if (str_last(&path_str) != '/') {
@@ -494,31 +1251,36 @@ void app_load_all_icon_themes (struct app_t *app)
         }
         uint32_t path_len = str_len (&path_str);
 
-        struct stat st;
-        if (stat(curr_search_path, &st) != -1 || errno != ENOENT) {
-            DIR *d = opendir (curr_search_path);
-            struct dirent *entry_info;
-            while (read_dir (d, &entry_info)) {
-                if (strcmp ("default", entry_info->d_name) != 0 && entry_info->d_name[0] != '.') {
-                    string_t theme_dir = str_new (entry_info->d_name);
-                    str_put (&path_str, path_len, &theme_dir);
-
-                    if (stat(str_data(&path_str), &st) == 0 && S_ISDIR(st.st_mode) &&
-                        file_lookup (str_data(&path_str), "index.theme")) {
-
-                        struct icon_theme_t *theme = app_icon_theme_new (app);
-                        theme->dir_name = pom_strdup (&theme->pool, entry_info->d_name);
-
-                        str_cat_c (&path_str, "/index.theme");
-                        theme->index_file = full_file_read (&theme->pool, str_data(&path_str));
-                        set_theme_name(theme);
+        struct dir_listing_t listing;
+        if (dir_cache_list (&app->dir_cache, str_data(&path_str), &listing)) {
+            for (int j=0; j<listing.num_entries; j++) {
+                char *entry_name = dir_listing_name (&listing, j);
+                if (listing.entries[j].type == DIR_ENTRY_DIR &&
+                    strcmp ("default", entry_name) != 0 && entry_name[0] != '.') {
+                    str_put_c (&path_str, path_len, entry_name);
+                    str_cat_c (&path_str, "/");
+
+                    struct dir_listing_t theme_listing;
+                    if (dir_cache_list (&app->dir_cache, str_data(&path_str), &theme_listing)) {
+                        for (int k=0; k<theme_listing.num_entries; k++) {
+                            if (theme_listing.entries[k].type == DIR_ENTRY_FILE &&
+                                strcmp (dir_listing_name (&theme_listing, k), "index.theme") == 0) {
+
+                                // NOTE: The index file is read later, only if
+                                // the theme can't be restored from the theme
+                                // cache.
+                                struct icon_theme_t *theme = app_icon_theme_new (app);
+                                theme->dir_name = pom_strdup (&theme->pool, entry_name);
+
+                                str_cat_c (&path_str, "index.theme");
+                                theme->index_fname = pom_strdup (&theme->pool, str_data(&path_str));
+                                break;
+                            }
+                        }
                     }
-                    str_free (&theme_dir);
                 }
             }
 
-            closedir (d);
-
         } else {
             // curr_search_path does not exist.
         }
@@ -529,7 +1291,7 @@ void app_load_all_icon_themes (struct app_t *app)
     // A theme can be spread across multiple search paths. Now that we know the
     // internal name for each theme, we look for subdirectories with this
     // internal name to know which directories a theme is spread across.
-    for (struct icon_theme_t *curr_theme = app->themes; curr_theme; curr_theme = curr_theme->next) {
+    for (struct icon_theme_t *curr_theme = app->found_themes; curr_theme; curr_theme = curr_theme->found_next) {
         char *found_dirs[num_paths];
         uint32_t num_found = 0;
         int j;
@@ -539,23 +1301,28 @@ void app_load_all_icon_themes (struct app_t *app)
             if (str_last(&path_str) != '/') {
                 str_cat_c (&path_str, "/");
             }
-            str_cat_c (&path_str, curr_theme->dir_name);
 
-            struct stat st;
-            if (stat(str_data(&path_str), &st) == 0 && S_ISDIR(st.st_mode)) {
-                found_dirs[num_found] = pom_strdup (&curr_theme->pool, str_data(&path_str));
-                num_found++;
+            struct dir_listing_t listing;
+            if (dir_cache_list (&app->dir_cache, str_data(&path_str), &listing)) {
+                for (int k=0; k<listing.num_entries; k++) {
+                    if (listing.entries[k].type == DIR_ENTRY_DIR &&
+                        strcmp (dir_listing_name (&listing, k), curr_theme->dir_name) == 0) {
+                        str_cat_c (&path_str, curr_theme->dir_name);
+                        found_dirs[num_found] = pom_strdup (&curr_theme->pool, str_data(&path_str));
+                        num_found++;
+                        break;
+                    }
+                }
             }
             str_free (&path_str);
         }
 
+        num_found = theme_clamp_num_dirs (curr_theme, num_found);
         curr_theme->dirs = (char**)pom_push_size (&curr_theme->pool, sizeof(char*)*num_found);
         memcpy (curr_theme->dirs, found_dirs, sizeof(char*)*num_found);
         curr_theme->num_dirs = num_found;
     }
 
-    icon_theme_sort (&app->themes, -1);
-
     // Unthemed icons are found inside search path directories but not in a
     // directory. For these icons we add a zero initialized theme, and set as
     // dirs all search paths with icons in them.
@@ -571,22 +1338,13 @@ void app_load_all_icon_themes (struct app_t *app)
         if (str_last(&path_str) != '/') {
             str_cat_c (&path_str, "/");
         }
-        uint32_t path_len = str_len (&path_str);
-
-        struct stat st;
-        if (stat(str_data(&path_str), &st) == -1 && errno == ENOENT) {
-            // NOTE: Current search paths may contain non existent directories.
-            //printf ("Search path does not exist.\n");
-            continue;
-        }
 
-        DIR *d = opendir (str_data(&path_str));
-        struct dirent *entry_info;
-        while (read_dir (d, &entry_info)) {
-            str_put_c (&path_str, path_len, entry_info->d_name);
-
-            if (stat(str_data(&path_str), &st) == 0 && S_ISREG(st.st_mode)) {
-                if (fname_has_valid_extension (entry_info->d_name, NULL)) {
+        struct dir_listing_t listing;
+        // NOTE: Current search paths may contain non existent directories.
+        if (dir_cache_list (&app->dir_cache, str_data(&path_str), &listing)) {
+            for (int j=0; j<listing.num_entries; j++) {
+                if (listing.entries[j].type == DIR_ENTRY_FILE &&
+                    fname_has_valid_extension (dir_listing_name (&listing, j), NULL)) {
                     uint32_t res_len = strlen (path[i]) + 1;
                     found_dirs[num_found] = (char*)pom_push_size (&no_theme->pool, res_len);
                     memcpy (found_dirs[num_found], path[i], res_len);
@@ -596,51 +1354,126 @@ void app_load_all_icon_themes (struct app_t *app)
             }
         }
         str_free (&path_str);
-        closedir (d);
     }
 
+    num_found = theme_clamp_num_dirs (no_theme, num_found);
     no_theme->dirs = (char**)pom_push_size (&no_theme->pool, sizeof(char*)*num_found);
     memcpy (no_theme->dirs, found_dirs, sizeof(char*)*num_found);
     no_theme->num_dirs = num_found;
 
-    // Find all icon names for each found theme and store them in the icon_names
-    // hash table.
-    for (struct icon_theme_t *curr_theme = app->themes; curr_theme; curr_theme = curr_theme->next) {
-        set_theme_icon_names (curr_theme);
-    }
+    // Restore each found theme from the theme cache, or find all its icon names
+    // with scan jobs if it changed.
+    {
+#ifdef THEME_SCAN_PARALLEL
+        GThreadPool *scan_pool =
+            g_thread_pool_new (theme_scan_job_run, NULL, g_get_num_processors(), TRUE, NULL);
+#endif
+
+        for (struct icon_theme_t *curr_theme = app->found_themes; curr_theme; curr_theme = curr_theme->found_next) {
+            if (theme_cache_restore (&theme_cache, curr_theme, &app->icon_name_table)) {
+                theme_load_finish (curr_theme);
+                continue;
+            }
 
-    // Add all icon themes into a structure so we can fake an "All" theme.
-    app->all_icon_names_pool = ZERO_INIT (mem_pool_t);
-    app->all_icon_names = g_tree_new (str_cmp_callback);
+            if (curr_theme->dir_name != NULL) {
+                curr_theme->index_file = full_file_read (&curr_theme->pool, curr_theme->index_fname);
+                theme_parse_index (curr_theme);
 
-    struct icon_theme_t *curr_theme = app->themes;
-    for (; curr_theme; curr_theme = curr_theme->next) {
-        GList *icon_names = g_hash_table_get_keys (curr_theme->icon_names);
-        for (GList *l = icon_names; l != NULL; l = l->next) {
-            if (!g_tree_lookup_extended (app->all_icon_names, l->data, NULL, NULL)) {
-                char *icon_name = pom_strdup (&app->all_icon_names_pool, l->data);
-                g_tree_insert (app->all_icon_names, icon_name, NULL);
+                curr_theme->icon_caches =
+                    pom_push_array (&curr_theme->pool, curr_theme->num_dirs, struct gtk_icon_cache_t);
+                for (int j=0; j<curr_theme->num_dirs; j++) {
+                    gtk_icon_cache_open (&curr_theme->icon_caches[j], curr_theme->dirs[j]);
+                }
+            }
+
+            theme_deps_compute (curr_theme);
+            theme_scan_jobs_create (curr_theme);
+            if (curr_theme->num_pending_scan_jobs == 0) {
+                theme_scan_finish (curr_theme);
+            }
+
+            struct theme_scan_job_t *job = curr_theme->scan_jobs;
+            while (job != NULL) {
+                // NOTE: Get the next job before running this one, the last job
+                // of a theme to finish destroys all of them.
+                struct theme_scan_job_t *next = job->next;
+#ifdef THEME_SCAN_PARALLEL
+                g_thread_pool_push (scan_pool, job, NULL);
+#else
+                theme_scan_job_run (job, NULL);
+#endif
+                job = next;
             }
         }
-        g_list_free (icon_names);
+
+#ifdef THEME_SCAN_PARALLEL
+        // Wait for all jobs to finish.
+        g_thread_pool_free (scan_pool, FALSE, TRUE);
+#endif
+    }
+
+    // Directories that weren't listed would be dropped from the cache file,
+    // and themes would be stored half scanned, keep the previous files if
+    // loading was cancelled.
+    if (!g_atomic_int_get (&app->load_cancelled)) {
+        dir_cache_save (&app->dir_cache);
+        theme_cache_save (&theme_cache, app->found_themes, &app->icon_name_table);
+    }
+    theme_cache_destroy (&theme_cache);
+}
+
+// Add a theme that has been completely scanned to the list of themes. Themes
+// are kept sorted by name, except the theme of unthemed icons which is always
+// first. Call app_all_theme_list_update() to add its icons to the All theme.
+void app_add_theme (struct app_t *app, struct icon_theme_t *theme)
+{
+    struct icon_theme_t **pos = &app->themes;
+    if (theme->dir_name != NULL) {
+        while (*pos != NULL &&
+               ((*pos)->dir_name == NULL || strcasecmp ((*pos)->name, theme->name) < 0)) {
+            pos = &(*pos)->next;
+        }
     }
+    theme->next = *pos;
+    *pos = theme;
 }
 
+void app_cancel_prefetch (struct app_t *app);
+
 void app_destroy (struct app_t *app)
 {
-    struct icon_theme_t *curr_theme = app->themes;
+    // Wait for running decodes, their results are never used.
+    g_atomic_int_inc (&app->icon_view_generation);
+    g_atomic_int_inc (&app->folder_theme_generation);
+    g_atomic_int_inc (&app->prefetch_generation);
+#ifdef PIXBUF_CACHE_PRINT_STATS
+    pixbuf_cache_print_stats (&app->pixbuf_loader.cache);
+#endif
+    app_cancel_prefetch (app);
+    pixbuf_loader_destroy (&app->pixbuf_loader);
+    if (app->image_probe_pool != NULL) {
+        g_thread_pool_free (app->image_probe_pool, TRUE, TRUE);
+    }
+
+    struct icon_theme_t *curr_theme = app->found_themes;
     while (curr_theme != NULL) {
         struct icon_theme_t *to_destroy = curr_theme;
-        curr_theme = curr_theme->next;
+        curr_theme = curr_theme->found_next;
 
         icon_theme_destroy (to_destroy);
     }
 
+    icon_view_destroy_images (&app->icon_view);
     mem_pool_destroy(&app->icon_view_pool);
     free (app->selected_icon);
 
-    mem_pool_destroy(&app->all_icon_names_pool);
-    g_tree_destroy (app->all_icon_names);
+    name_table_destroy (&app->icon_name_table);
+
+    icon_search_reset (&app->all_theme_search);
+    icon_search_reset (&app->normal_theme_search);
+    icon_search_reset (&app->folder_theme_search);
+
+    dir_cache_destroy (&app->dir_cache);
 }
 
 // This makes scalable images always sort as the largest.
@@ -657,9 +1490,13 @@ templ_sort_ll(icon_image_sort, struct icon_image_t, is_img_lt(*a, *b))
 
 // Some of the information in the icon view is derived from the base information
 // taken from the icon database (or faked for the folder theme or the unthemed
-// theme). This fuction computes that.
-void icon_view_compute_derived_data (mem_pool_t *pool, struct icon_view_t *icon_view)
+// theme). This fuction computes that. Images aren't created here, that
+// happens the first time their scale is shown, see icon_view_realize_scale().
+// Generation is used to decode them.
+void icon_view_compute_derived_data (mem_pool_t *pool, struct icon_view_t *icon_view, gint *generation)
 {
+    icon_view->generation = generation;
+
     for (int i=0; i<ARRAY_SIZE(icon_view->images); i++) {
         struct icon_image_t *img = icon_view->images[i];
 
@@ -679,29 +1516,6 @@ void icon_view_compute_derived_data (mem_pool_t *pool, struct icon_view_t *icon_
             // Set back pointer into icon_view_t
             img->view = icon_view;
 
-            // Create a GtkImage for the found image
-            img->image = gtk_image_new_from_file (img->full_path);
-            struct stat st;
-            stat(img->full_path, &st);
-            img->file_size = st.st_size;
-            gtk_widget_set_valign (img->image, GTK_ALIGN_END);
-
-            // Find the size of the created image
-            GdkPixbuf *pixbuf = gtk_image_get_pixbuf (GTK_IMAGE(img->image));
-            if (pixbuf) {
-                img->width = gdk_pixbuf_get_width(pixbuf);
-                img->height = gdk_pixbuf_get_height(pixbuf);
-            }
-            gtk_widget_set_size_request (img->image, img->width, img->height);
-
-            g_assert (img->image != NULL);
-            // The container to which images will be parented will get destroyed
-            // when changing icon scales, we need to take a reference here so we
-            // can go back to them. The lifespan of these images should be equal
-            // to icon_view_t, not to their parent container.
-            // @scale_change_destroys_images
-            g_object_ref_sink (G_OBJECT(img->image));
-
             img = img->next;
         }
 
@@ -745,135 +1559,85 @@ void icon_view_compute (mem_pool_t *pool,
     icon_view->scale = 1;
     icon_view->icon_name = pom_strndup (pool, icon_name, strlen(icon_name));
 
-    if (theme->index_file != NULL) {
-        bool found_image = false;
-        int i;
-        for (i = 0; i < theme->num_dirs; i++) {
-            string_t path = str_new (theme->dirs[i]);
+    struct icon_postings_t *postings = icon_theme_get_postings (theme, icon_name);
+    assert (postings != NULL && "Icon not found in that theme");
+
+    if (theme->dir_name != NULL) {
+        // If we found something in a search path then stop looking in the
+        // other ones. Locations are sorted by base directory so all images
+        // come from the first one with an image we can show.
+        int found_base_dir = -1;
+        for (uint32_t i = 0; i < postings->num_locations; i++) {
+            struct icon_location_t *loc = &postings->locations[i];
+            if (found_base_dir != -1 && loc->base_dir != found_base_dir) break;
+
+            struct theme_section_t *section = &theme->sections[loc->section];
+
+            string_t path = str_new (theme->dirs[loc->base_dir]);
             if (str_last (&path) != '/') {
                 str_cat_c (&path, "/");
             }
             uint32_t path_len = str_len (&path);
-            char *c = theme->index_file;
-
-            // Ignore the first section: [Icon Theme]
-            c = seek_next_section (c, NULL, NULL);
-            c = consume_section (c);
-
-            while (*c) {
-                // FIXME: We currently ignore the Directories key in the first
-                // section [Icon Theme], some themes (Oxygen) have repeated
-                // directory sections while they are unique in the Directories
-                // key. Icons in these folders will show several times. Maybe
-                // read the Directories key or do nothing so theme developers
-                // can notice something strange is going on.
-                char *section_name;
-                uint32_t section_name_len;
-                c = seek_next_section (c, &section_name, &section_name_len);
-                string_t dir = strn_new (section_name, section_name_len);
-                str_put (&path, path_len, &dir);
-
-                char *icon_path;
-                if (icon_lookup (pool, str_data (&path), icon_name, &icon_path)) {
-                    // TODO: Maybe get this information before looking up the directory
-                    // and conditionally call icon_lookup() depending on the information
-                    // we get.
-
-                    struct icon_image_t img = ZERO_INIT(struct icon_image_t);
-                    mem_pool_temp_marker_t mrkr = mem_pool_begin_temporary_memory (pool);
-                    img.scale = 1;
-                    img.min_size = -1;
-                    img.max_size = -1;
-                    img.size = -1;
-                    int icon_path_len = strlen(icon_path);
-                    img.full_path = pom_strndup (pool, icon_path, icon_path_len);
-                    img.theme_dir = pom_strndup (pool, icon_path, path_len);
-                    img.path = pom_strndup (pool, icon_path + path_len, icon_path_len - path_len);
-
-                    // NOTE: We say an image is scalable if dir contains the
-                    // substring "scalable" as this is what developers seem to
-                    // use. The index file may disagree, and Gtk for example
-                    // makes any .svg icon 'scalable' no matter what the index
-                    // file or dir says.
-                    img.is_scalable = strstr (str_data(&dir), "scalable") != NULL ? true : false;
-
-                    while ((c = consume_ignored_lines (c)) && !is_end_of_section(c)) {
-                        char *key, *value;
-                        uint32_t key_len, value_len;
-                        c = seek_next_key_value (c, &key, &key_len, &value, &value_len);
-                        if (strncmp (key, "Size", MIN(4, key_len)) == 0) {
-                            sscanf (value, "%"SCNi32, &img.size);
-
-                        } else if (strncmp (key, "MinSize", MIN(7, key_len)) == 0) {
-                            sscanf (value, "%"SCNi32, &img.min_size);
-
-                        } else if (strncmp (key, "MaxSize", MIN(7, key_len)) == 0) {
-                            sscanf (value, "%"SCNi32, &img.max_size);
-
-                        } else if (strncmp (key, "Scale", MIN(5, key_len)) == 0) {
-                            sscanf (value, "%"SCNi32, &img.scale);
-
-                        } else if (strncmp (key, "Type", MIN(4, key_len)) == 0) {
-                            img.type = pom_strndup (pool, value, value_len);
-
-                        } else if (strncmp (key, "Context", MIN(7, key_len)) == 0) {
-                            img.context = pom_strndup (pool, value, value_len);
-                        }
-                    }
-
-                    // Create the icon_image_t structure inside pool.
-                    struct icon_image_t *new_img =
-                        mem_pool_push_size (pool, sizeof(struct icon_image_t));
-                    *new_img = img;
-
-                    // Add the new image at the end of the corresponding linked list
-                    if (icon_view_push_image (icon_view, new_img)) {
-                        found_image = true;
-                    } else {
-                        mem_pool_end_temporary_memory (mrkr);
-                    }
-
-                } else {
-                    c = consume_section (c);
-                }
-
-                str_free (&dir);
+            str_cat_c (&path, section->name);
+            str_cat_c (&path, "/");
+            str_cat_c (&path, icon_name);
+            str_cat_c (&path, app.valid_extensions[loc->ext]);
+
+            struct icon_image_t img = ZERO_INIT(struct icon_image_t);
+            mem_pool_temp_marker_t mrkr = mem_pool_begin_temporary_memory (pool);
+            img.full_path = pom_strndup (pool, str_data(&path), str_len(&path));
+            img.theme_dir = pom_strndup (pool, str_data(&path), path_len);
+            img.path = pom_strndup (pool, str_data(&path) + path_len, str_len(&path) - path_len);
+            img.size = section->size;
+            img.min_size = section->min_size;
+            img.max_size = section->max_size;
+            img.scale = section->scale;
+            img.type = section->type;
+            img.context = section->context;
+            img.is_scalable = section->is_scalable;
+
+            // Create the icon_image_t structure inside pool.
+            struct icon_image_t *new_img =
+                mem_pool_push_size (pool, sizeof(struct icon_image_t));
+            *new_img = img;
+
+            // Add the new image at the end of the corresponding linked list
+            if (icon_view_push_image (icon_view, new_img)) {
+                found_base_dir = loc->base_dir;
+            } else {
+                mem_pool_end_temporary_memory (mrkr);
             }
 
             str_free (&path);
-
-            // If we found something in a search path then stop looking in the
-            // other ones.
-            if (found_image) break;
         }
 
-        assert (found_image && "Icon not found in that theme");
+        assert (found_base_dir != -1 && "Icon not found in that theme");
 
     } else {
-        int i;
-        for (i = 0; i < theme->num_dirs; i++) {
-            string_t path = str_new (theme->dirs[i]);
+        for (uint32_t i = 0; i < postings->num_locations; i++) {
+            struct icon_location_t *loc = &postings->locations[i];
+
+            string_t path = str_new (theme->dirs[loc->base_dir]);
             if (str_last (&path) != '/') {
                 str_cat_c (&path, "/");
             }
+            str_cat_c (&path, icon_name);
+            str_cat_c (&path, app.valid_extensions[loc->ext]);
 
-            char *icon_path;
-            if (icon_lookup (pool, str_data (&path), icon_name, &icon_path)) {
-                struct icon_image_t *new_img =
-                    mem_pool_push_size (pool, sizeof(struct icon_image_t));
-                *new_img = ZERO_INIT(struct icon_image_t);
-                new_img->path = pom_strndup(pool, icon_path, strlen(icon_path));
-                new_img->full_path = new_img->path;
-                new_img->scale = 1;
+            struct icon_image_t *new_img =
+                mem_pool_push_size (pool, sizeof(struct icon_image_t));
+            *new_img = ZERO_INIT(struct icon_image_t);
+            new_img->path = pom_strndup(pool, str_data(&path), str_len(&path));
+            new_img->full_path = new_img->path;
+            new_img->scale = 1;
 
-                icon_view_push_image (icon_view, new_img);
-            }
+            icon_view_push_image (icon_view, new_img);
 
             str_free (&path);
         }
     }
 
-    icon_view_compute_derived_data (pool, icon_view);
+    icon_view_compute_derived_data (pool, icon_view, &app.icon_view_generation);
 }
 
 void app_update_selected_icon (struct app_t *app, const char *selected_icon)
@@ -890,22 +1654,10 @@ void app_update_selected_icon (struct app_t *app, const char *selected_icon)
 
 void app_set_icon_view (struct app_t *app, const char *icon_name)
 {
-    // Unref all GtkImages before creating the new icon_view. I don't like this,
-    // istead of storing a GtkImage we should store our own data structure that
-    // has things inside icon_view_pool.
-    // @scale_change_destroys_images
-    for (int i=0; i<ARRAY_SIZE(app->icon_view.images); i++) {
-        struct icon_image_t *img = app->icon_view.images[i];
-
-        while (img != NULL) {
-            if (img->image != NULL) {
-                g_object_unref (G_OBJECT(img->image));
-            }
-            img = img->next;
-        }
-    }
-
-    // Update data in the icon_view_t structure
+    // Update data in the icon_view_t structure. Decodes still pending for
+    // the old icon view are dropped.
+    g_atomic_int_inc (&app->icon_view_generation);
+    icon_view_destroy_images (&app->icon_view);
     mem_pool_destroy (&app->icon_view_pool);
     app->icon_view_pool = ZERO_INIT(mem_pool_t);
     app_update_selected_icon (app, icon_name);
@@ -914,16 +1666,118 @@ void app_set_icon_view (struct app_t *app, const char *icon_name)
     replace_wrapped_widget_deferred (&app->icon_view_widget, draw_icon_view (&app->icon_view));
 }
 
-void on_icon_selected (GtkListBox *box, GtkListBoxRow *row, gpointer user_data)
+// The theme from which the All theme shows icon_name.
+struct icon_theme_t* app_all_theme_icon_theme (struct app_t *app, const char *icon_name)
 {
-    if (row == NULL) {
-        return;
+    struct icon_theme_t *theme;
+    for (theme = app->themes; theme; theme = theme->next) {
+        if (icon_theme_has_icon (theme, icon_name)) break;
     }
+    assert (theme != NULL);
+    return theme;
+}
 
-    GtkWidget *row_label = gtk_bin_get_child (GTK_BIN(row));
-    const char *icon_name = gtk_label_get_text (GTK_LABEL(row_label));
+// Number of rows above and below the selected one whose images are decoded in
+// the background. When the selection is moved with the keyboard, the icon
+// view of the new row finds them in the pixbuf cache.
+#define ICON_LIST_PREFETCH_ROWS 4
 
+void app_prefetch_icon_view (struct app_t *app, struct icon_view_t *icon_view)
+{
+    for (struct icon_image_t *img = icon_view->images[0]; img != NULL; img = img->next) {
+        if (!img->realized) {
+            pixbuf_loader_prefetch (&app->pixbuf_loader, img->full_path, -1, &app->prefetch_generation);
+        }
+    }
+}
+
+void app_cancel_prefetch (struct app_t *app)
+{
+    if (app->prefetch_idle != 0) {
+        g_source_remove (app->prefetch_idle);
+        app->prefetch_idle = 0;
+    }
+    mem_pool_destroy (&app->prefetch_pool);
+    app->prefetch_pool = ZERO_INIT (mem_pool_t);
+    app->prefetch_names = NULL;
+    app->num_prefetch_names = 0;
+    app->next_prefetch_name = 0;
+}
+
+// Prefetches the next row, one per iteration so the main loop is never busy
+// computing icon views for long.
+gboolean app_prefetch_idle (gpointer data)
+{
+    struct app_t *app = (struct app_t*)data;
+
+    // The theme changed without selecting a row, the names may not be in it.
+    if (app->selected_theme_type != app->prefetch_theme_type ||
+        (app->selected_theme_type == THEME_TYPE_NORMAL && app->selected_theme != app->prefetch_theme)) {
+        app->prefetch_idle = 0;
+        app_cancel_prefetch (app);
+        return G_SOURCE_REMOVE;
+    }
+
+    const char *icon_name = app->prefetch_names[app->next_prefetch_name++];
+    if (app->selected_theme_type == THEME_TYPE_FOLDER) {
+        struct icon_view_t *icon_view = g_tree_lookup (app->folder_theme_icon_names, icon_name);
+        if (icon_view != NULL) {
+            app_prefetch_icon_view (app, icon_view);
+        }
+
+    } else {
+        struct icon_theme_t *theme = app->selected_theme;
+        if (app->selected_theme_type == THEME_TYPE_ALL) {
+            theme = app_all_theme_icon_theme (app, icon_name);
+        }
+
+        mem_pool_t pool = {0};
+        struct icon_view_t icon_view;
+        icon_view_compute (&pool, theme, icon_name, &icon_view);
+        app_prefetch_icon_view (app, &icon_view);
+        mem_pool_destroy (&pool);
+    }
+
+    if (app->next_prefetch_name == app->num_prefetch_names) {
+        app->prefetch_idle = 0;
+        app_cancel_prefetch (app);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Prefetch the first scale of the icon views of the rows around idx, nearest
+// ones first. This only copies the names of the rows, icon views are computed
+// from a low priority idle. Prefetches for the previous selection that didn't
+// start yet are dropped.
+void app_prefetch_neighbor_rows (struct app_t *app, struct fk_list_box_t *fk_list_box, int idx)
+{
+    g_atomic_int_inc (&app->prefetch_generation);
+    app_cancel_prefetch (app);
+
+    app->prefetch_theme_type = app->selected_theme_type;
+    app->prefetch_theme = app->selected_theme;
+    app->prefetch_names = pom_push_array (&app->prefetch_pool, 2*ICON_LIST_PREFETCH_ROWS, char*);
+    for (int dist=1; dist<=ICON_LIST_PREFETCH_ROWS; dist++) {
+        int neighbors[] = {idx + dist, idx - dist};
+        for (int i=0; i<ARRAY_SIZE(neighbors); i++) {
+            if (neighbors[i] >= 0 && neighbors[i] < fk_list_box->num_visible_rows) {
+                app->prefetch_names[app->num_prefetch_names++] =
+                    pom_strdup (&app->prefetch_pool, fk_list_box->visible_rows[neighbors[i]]->data);
+            }
+        }
+    }
+
+    if (app->num_prefetch_names > 0) {
+        app->prefetch_idle = g_idle_add_full (G_PRIORITY_LOW, app_prefetch_idle, app, NULL);
+    }
+}
+
+FK_LIST_BOX_ROW_SELECTED_CB (on_normal_theme_row_selected)
+{
+    const char *icon_name = fk_list_box->visible_rows[idx]->data;
     app_set_icon_view (&app, icon_name);
+    app_prefetch_neighbor_rows (&app, fk_list_box, idx);
 }
 
 FK_LIST_BOX_ROW_SELECTED_CB (on_all_theme_row_selected)
@@ -931,15 +1785,11 @@ FK_LIST_BOX_ROW_SELECTED_CB (on_all_theme_row_selected)
     const char *icon_name = fk_list_box->visible_rows[idx]->data;
 
     if (app.selected_theme_type == THEME_TYPE_ALL) {
-        struct icon_theme_t *theme;
-        for (theme = app.themes; theme; theme = theme->next) {
-            if (g_hash_table_contains (theme->icon_names, icon_name)) break;
-        }
-        assert (theme != NULL);
-        app.selected_theme = theme;
+        app.selected_theme = app_all_theme_icon_theme (&app, icon_name);
     }
 
     app_set_icon_view (&app, icon_name);
+    app_prefetch_neighbor_rows (&app, fk_list_box, idx);
 }
 
 gboolean on_key_press (GtkWidget *widget, GdkEventKey *event, gpointer data) {
@@ -950,70 +1800,124 @@ gboolean on_key_press (GtkWidget *widget, GdkEventKey *event, gpointer data) {
     return FALSE;
 }
 
-gboolean search_filter (GtkListBoxRow *row, gpointer user_data)
+// Resolves keyed terms of search queries that name a facet, like
+// "context:Status", into the rows of fk_list_box that have that facet value.
+// Keys are the ones in icon_facet_type_names.
+//
+// Facets were computed when themes were scanned, so this doesn't touch the
+// filesystem. For the normal theme list the rows are the positions of
+// sorted_icon_names, so facet bits are used directly. For the All theme list
+// the facets of each theme are mapped to the list through all_theme_rows, an
+// icon has a facet value if it has it in any theme. Folder themes have no
+// index file, so no row of their list has any facet value.
+ICON_SEARCH_KEYED_TERM_CB(app_facet_term)
 {
-    const gchar *search_str = gtk_entry_get_text (GTK_ENTRY(app.search_entry));
-    GtkWidget *row_label = gtk_bin_get_child (GTK_BIN(row));
-    const char * icon_name = gtk_label_get_text (GTK_LABEL(row_label));
+    struct app_t *app = (struct app_t*)data;
 
-    return strstr (icon_name, search_str) != NULL ? TRUE : FALSE;
-}
+    int type;
+    for (type=0; type<NUM_ICON_FACET_TYPES; type++) {
+        if (g_ascii_strcasecmp (key, icon_facet_type_names[type]) == 0) break;
+    }
 
-// The only way to iterate through a GTree is using a callback an
-// g_tree_foreach, this is the callback that builds the "All" theme icon name
-// list.
-struct all_theme_list_build_clsr_t {
-    GtkWidget *new_icon_list;
-    bool first;
-    const char *selected_icon;
-};
+    if (type == NUM_ICON_FACET_TYPES) {
+        return false;
+    } else if (res == NULL) {
+        return true;
+    }
 
-GtkWidget *icon_list_new (const char *theme_name, const char *selected_icon, const char **choosen_icon)
-{
-    assert (choosen_icon != NULL);
+    if (*value == '\0') {
+        memset (res, 0xFF, ((fk_list_box->num_rows + 63)/64)*sizeof(uint64_t));
 
-    struct icon_theme_t *theme;
-    for (theme = app.themes; theme; theme = theme->next) {
-        if (strcmp (theme_name, theme->name) == 0) break;
+    } else if (fk_list_box == &app->normal_theme_fk_list_box) {
+        struct icon_theme_t *theme = app->selected_theme;
+        struct icon_facet_t *facet = icon_theme_get_facet (theme, type, value);
+        if (facet != NULL) {
+            memcpy (res, facet->bits, ((theme->icon_names.count + 63)/64)*sizeof(uint64_t));
+        }
+
+    } else if (fk_list_box == &app->all_theme_fk_list_box) {
+        for (struct icon_theme_t *theme = app->themes; theme; theme = theme->next) {
+            struct icon_facet_t *facet = icon_theme_get_facet (theme, type, value);
+            if (facet == NULL) continue;
+
+            uint32_t theme_words = (theme->icon_names.count + 63)/64;
+            for (uint32_t w=0; w<theme_words; w++) {
+                uint64_t bits = facet->bits[w];
+                while (bits != 0) {
+                    uint32_t row = theme->all_theme_rows[w*64 + __builtin_ctzll (bits)];
+                    res[row/64] |= (uint64_t)1 << (row%64);
+                    bits &= bits - 1;
+                }
+            }
+        }
     }
-    assert (theme != NULL && "Theme name not found");
 
-    GtkWidget *new_icon_list = gtk_list_box_new ();
-    gtk_widget_set_vexpand (new_icon_list, TRUE);
-    gtk_widget_set_hexpand (new_icon_list, TRUE);
-    gtk_list_box_set_filter_func (GTK_LIST_BOX(new_icon_list), search_filter, NULL, NULL);
+    return true;
+}
 
-    GList *icon_names = g_hash_table_get_keys (theme->icon_names);
-    icon_names = g_list_sort (icon_names, strcase_cmp_callback);
+// Filter fk_list_box using the query in the search entry, in the currently
+// selected search mode. Queries may combine several terms, including facets,
+// see icon_search_query().
+//
+// When async is false, exact searches are applied right away. This is used
+// after the rows of a list are created, so the list never shows rows that
+// don't match.
+void app_search_list (struct app_t *app, struct icon_search_t *search,
+                      struct fk_list_box_t *fk_list_box, bool async)
+{
+    const gchar *search_str = gtk_entry_get_text (GTK_ENTRY(app->search_entry));
+    icon_search_query (search, fk_list_box, search_str,
+                       app->search_fuzzy ? ICON_SEARCH_FUZZY : ICON_SEARCH_EXACT, async,
+                       app_facet_term, app);
+}
 
-    bool first = true;
-    GList *l = NULL;
-    for (l = icon_names; l != NULL; l = l->next)
-    {
-        GtkWidget *row = gtk_label_new (l->data);
-        gtk_container_add (GTK_CONTAINER(new_icon_list), row);
-        gtk_widget_set_halign (row, GTK_ALIGN_START);
+// Fill the normal theme list with the icons of theme and select selected_icon
+// in it, or the first icon if selected_icon is NULL or not in theme. Returns
+// the name of the selected icon.
+//
+// No widgets are created here, rows just point to the already sorted names of
+// the theme, so switching themes is cheap even for themes with thousands of
+// icons.
+const char* app_normal_theme_list_update (struct app_t *app, struct icon_theme_t *theme,
+                                          const char *selected_icon)
+{
+    struct fk_list_box_t *fk_list_box = &app->normal_theme_fk_list_box;
 
-        if (selected_icon == NULL && first) {
-            first = false;
-            selected_icon = l->data;
-        }
+    // The caller shows the icon view of the returned icon.
+    fk_list_box_cancel_row_selected (fk_list_box);
 
-        if (strcmp (selected_icon, l->data) == 0) {
-            GtkWidget *r = gtk_widget_get_parent (row);
-            gtk_list_box_select_row (GTK_LIST_BOX(new_icon_list), GTK_LIST_BOX_ROW(r));
-        }
+    uint32_t num_names = theme->icon_names.count;
+    fk_list_box_rows_start (fk_list_box, num_names);
+    for (uint32_t i=0; i<num_names; i++) {
+        struct fk_list_box_row_t *row = fk_list_box_row_new (fk_list_box);
+        row->data = theme->sorted_icon_names[i];
+    }
 
-        gtk_widget_set_margin_start (row, 6);
-        gtk_widget_set_margin_end (row, 6);
-        gtk_widget_set_margin_top (row, 3);
-        gtk_widget_set_margin_bottom (row, 3);
+    const char *choosen_icon = num_names > 0 ? theme->sorted_icon_names[0] : NULL;
+    if (selected_icon != NULL) {
+        // Binary search selected_icon in the sorted names, they are sorted with
+        // str_cmp_callback() so we must compare with the same function.
+        uint32_t lo = 0, hi = num_names;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo)/2;
+            int cmp = str_cmp_callback (theme->sorted_icon_names[mid], selected_icon);
+            if (cmp == 0) {
+                fk_list_box->selected_row = &fk_list_box->rows[mid];
+                fk_list_box->selected_row_idx = mid;
+                choosen_icon = theme->sorted_icon_names[mid];
+                break;
+            } else if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
     }
-    g_list_free (icon_names);
 
-    *choosen_icon = selected_icon;
-    g_signal_connect (G_OBJECT(new_icon_list), "row-selected", G_CALLBACK (on_icon_selected), NULL);
-    return new_icon_list;
+    icon_search_prepare (&app->normal_theme_search, fk_list_box, false);
+    app_search_list (app, &app->normal_theme_search, fk_list_box, false);
+
+    return choosen_icon;
 }
 
 void on_theme_changed (GtkComboBox *themes_combobox, gpointer user_data);
@@ -1078,9 +1982,11 @@ void app_set_normal_theme (struct app_t *app, const char *theme_name, const char
 
     app_set_selected_theme (app, theme_name);
 
-    const char *choosen_icon = selected_icon;
-    GtkWidget *new_icon_list = icon_list_new (theme_name, selected_icon, &choosen_icon);
-    replace_wrapped_widget (&app->icon_list, new_icon_list);
+    const char *choosen_icon =
+        app_normal_theme_list_update (app, app->selected_theme, selected_icon);
+    if (app->icon_list != app->normal_theme_widget) {
+        replace_wrapped_widget (&app->icon_list, app->normal_theme_widget);
+    }
 
     GtkWidget *new_theme_selector = theme_selector_new (theme_name);
     replace_wrapped_widget_deferred (&app->theme_selector, new_theme_selector);
@@ -1093,52 +1999,245 @@ void app_set_all_theme (struct app_t *app)
 {
     app->selected_theme_type = THEME_TYPE_ALL;
 
+    replace_wrapped_widget (&app->icon_list, app->all_icon_names_widget);
+
+    if (!GTK_IS_COMBO_BOX(app->theme_selector) ||
+        gtk_combo_box_get_active_id (GTK_COMBO_BOX(app->theme_selector)) != g_intern_string ("All")) {
+        GtkWidget *new_theme_selector = theme_selector_new ("All");
+        replace_wrapped_widget_deferred (&app->theme_selector, new_theme_selector);
+    }
+
+    if (app->themes == NULL) {
+        // Themes are still being loaded, the icon will be set when the first
+        // one is added, see app_theme_loaded_idle().
+        app->selected_theme = NULL;
+        return;
+    }
+
     // Set the selected theme as the first theme that contains the first icon in
     // the All theme icon name list.
     struct icon_theme_t *theme;
     for (theme = app->themes; theme; theme = theme->next) {
-        if (g_hash_table_contains (theme->icon_names, app->all_icon_names_first)) break;
+        if (icon_theme_has_icon (theme, app->all_icon_names_first)) break;
     }
     assert (theme != NULL && "Real theme for All theme not found");
     app->selected_theme = theme;
 
-    replace_wrapped_widget (&app->icon_list, app->all_icon_names_widget);
+    app_update_selected_icon (app, app->all_icon_names_first);
+    app_set_icon_view (app, app->selected_icon);
+}
 
-    if (!GTK_IS_COMBO_BOX(app->theme_selector) ||
-        gtk_combo_box_get_active_id (GTK_COMBO_BOX(app->theme_selector)) != g_intern_string ("All")) {
-        GtkWidget *new_theme_selector = theme_selector_new ("All");
-        replace_wrapped_widget_deferred (&app->theme_selector, new_theme_selector);
+// Cursor into the sorted icon names of a theme, used as an element of the heap
+// that merges the names of all themes.
+struct icon_names_cursor_t {
+    struct icon_theme_t *theme;
+    char **name;
+    char **end;
+};
+
+static inline
+bool icon_names_cursor_lt (struct icon_names_cursor_t *a, struct icon_names_cursor_t *b)
+{
+    return str_cmp_callback (*a->name, *b->name) < 0;
+}
+
+void icon_names_heap_sift_down (struct icon_names_cursor_t *heap, int heap_len, int idx)
+{
+    while (true) {
+        int smallest = idx;
+        int l = 2*idx + 1;
+        int r = 2*idx + 2;
+        if (l < heap_len && icon_names_cursor_lt (&heap[l], &heap[smallest])) {
+            smallest = l;
+        }
+        if (r < heap_len && icon_names_cursor_lt (&heap[r], &heap[smallest])) {
+            smallest = r;
+        }
+
+        if (smallest == idx) {
+            break;
+        }
+
+        struct icon_names_cursor_t tmp = heap[idx];
+        heap[idx] = heap[smallest];
+        heap[smallest] = tmp;
+        idx = smallest;
     }
+}
 
-    app_update_selected_icon (app, app->all_icon_names_first);
-    app_set_icon_view (app, app->selected_icon);
+// Rebuild the rows of the All theme list from the icon names of all themes.
+// The selected row and the current search are kept.
+//
+// The sorted name arrays of all themes are merged with a heap. Names are
+// interned, so a name that is in several themes is always the same pointer,
+// and because equal names come out of the heap one after the other, removing
+// duplicates only requires comparing with the last added name. While merging
+// we also store in theme->all_theme_rows where each icon of a theme ends up,
+// this is what maps facets of themes to rows of the list.
+void app_all_theme_list_update (struct app_t *app)
+{
+    struct fk_list_box_t *fk_list_box = &app->all_theme_fk_list_box;
+
+    const char *selected_icon = NULL;
+    if (fk_list_box->num_rows > 0) {
+        selected_icon = fk_list_box->selected_row->data;
+    }
+
+    int num_themes = 0;
+    uint32_t max_names = 0;
+    for (struct icon_theme_t *theme = app->themes; theme; theme = theme->next) {
+        num_themes++;
+        max_names += theme->icon_names.count;
+    }
+
+    int heap_len = 0;
+    struct icon_names_cursor_t heap[MAX(num_themes, 1)];
+    for (struct icon_theme_t *theme = app->themes; theme; theme = theme->next) {
+        theme->all_theme_rows =
+            realloc (theme->all_theme_rows, MAX(theme->icon_names.count, 1)*sizeof(uint32_t));
+
+        if (theme->icon_names.count > 0) {
+            heap[heap_len].theme = theme;
+            heap[heap_len].name = theme->sorted_icon_names;
+            heap[heap_len].end = theme->sorted_icon_names + theme->icon_names.count;
+            heap_len++;
+        }
+    }
+
+    for (int i=heap_len/2 - 1; i>=0; i--) {
+        icon_names_heap_sift_down (heap, heap_len, i);
+    }
+
+    uint32_t num_names = 0;
+    char **names = malloc (MAX(max_names, 1)*sizeof(char*));
+    while (heap_len > 0) {
+        char *name = *heap[0].name;
+        if (num_names == 0 || names[num_names-1] != name) {
+            names[num_names++] = name;
+        }
+
+        struct icon_theme_t *theme = heap[0].theme;
+        theme->all_theme_rows[heap[0].name - theme->sorted_icon_names] = num_names - 1;
+
+        heap[0].name++;
+        if (heap[0].name == heap[0].end) {
+            heap[0] = heap[heap_len-1];
+            heap_len--;
+        }
+        icon_names_heap_sift_down (heap, heap_len, 0);
+    }
+
+    fk_list_box_rows_start (fk_list_box, num_names);
+    for (uint32_t i=0; i<num_names; i++) {
+        struct fk_list_box_row_t *row = fk_list_box_row_new (fk_list_box);
+        row->data = names[i];
+
+        if (names[i] == selected_icon) {
+            fk_list_box->selected_row = row;
+            fk_list_box->selected_row_idx = i;
+        }
+    }
+    free (names);
+
+    if (fk_list_box->num_rows > 0) {
+        app->all_icon_names_first = fk_list_box->rows[0].data;
+    }
+
+    icon_search_prepare (&app->all_theme_search, fk_list_box, true);
+    app_search_list (app, &app->all_theme_search, fk_list_box, false);
 }
 
-FK_LIST_BOX_ROW_SELECTED_CB (on_folder_theme_row_selected)
+// Recreate the theme selector so it lists all themes currently loaded.
+void app_theme_selector_update (struct app_t *app)
 {
-    const char *icon_name = fk_list_box->visible_rows[idx]->data;
-    struct icon_view_t *icon_view = g_tree_lookup (app.folder_theme_icon_names, icon_name);
+    const char *theme_name = NULL;
+    if (app->selected_theme_type == THEME_TYPE_ALL) {
+        theme_name = "All";
+    } else if (app->selected_theme_type == THEME_TYPE_NORMAL) {
+        theme_name = app->selected_theme->name;
+    }
 
-    // Unparent GtkImages before creating the new icon_view. draw_icon_view()
-    // will try to parent all image widgets, if we are showing this icon_view,
-    // then it will already have a parent and Gtk will complain. This can be
-    // removed if we stop using GtkImage to store images!.
-    for (int i=0; i<ARRAY_SIZE(icon_view->images); i++) {
-        struct icon_image_t *img = icon_view->images[i];
+    GtkWidget *new_theme_selector = theme_selector_new (theme_name);
+    replace_wrapped_widget_deferred (&app->theme_selector, new_theme_selector);
+}
 
-        while (img != NULL) {
-            if (img->image != NULL) {
-                GtkWidget *parent = gtk_widget_get_parent (img->image);
-                if (parent != NULL)
-                    gtk_container_remove (GTK_CONTAINER(parent), img->image);
+// Loaded themes are added to the UI at most once every this many
+// milliseconds. Many themes finish at about the same time, and rebuilding the
+// All theme list and its search index for each one of them is wasted work.
+#define ALL_THEME_UPDATE_MS 150
+
+gboolean app_add_loaded_themes_timeout (gpointer data)
+{
+    app.all_theme_update_timeout = 0;
+
+    while (app.loaded_themes != NULL) {
+        struct icon_theme_t *theme = app.loaded_themes;
+        app.loaded_themes = theme->next;
+        app_add_theme (&app, theme);
+    }
+    app_all_theme_list_update (&app);
+
+    if (app.selected_theme_type == THEME_TYPE_ALL && app.selected_theme == NULL) {
+        // These are the first loaded themes, app_set_all_theme() also updates
+        // the theme selector.
+        app_set_all_theme (&app);
+    } else {
+        app_theme_selector_update (&app);
+
+        // A theme that sorts before the one the selected icon is shown from
+        // may have it too, then the All theme must show it from there.
+        if (app.selected_theme_type == THEME_TYPE_ALL && app.selected_icon != NULL) {
+            struct icon_theme_t *theme = app_all_theme_icon_theme (&app, app.selected_icon);
+            if (theme != app.selected_theme) {
+                app.selected_theme = theme;
+                app_set_icon_view (&app, app.selected_icon);
             }
-            img = img->next;
         }
     }
 
+    return FALSE;
+}
+
+// Called in the main thread for each theme loaded by the background thread.
+// The theme is added to the UI by app_add_loaded_themes_timeout(), together
+// with the other ones that finish loading before it runs.
+gboolean app_theme_loaded_idle (gpointer data)
+{
+    struct icon_theme_t *theme = (struct icon_theme_t*)data;
+    theme->next = app.loaded_themes;
+    app.loaded_themes = theme;
+
+    if (app.all_theme_update_timeout == 0) {
+        app.all_theme_update_timeout =
+            g_timeout_add (ALL_THEME_UPDATE_MS, app_add_loaded_themes_timeout, NULL);
+    }
+
+    return FALSE;
+}
+
+struct app_load_all_icon_themes_clsr_t {
+    gchar **path;
+    gint num_paths;
+};
+
+gpointer app_load_all_icon_themes_thread (gpointer data)
+{
+    struct app_load_all_icon_themes_clsr_t *clsr = (struct app_load_all_icon_themes_clsr_t*)data;
+    app_load_all_icon_themes (&app, clsr->path, clsr->num_paths);
+
+    g_strfreev (clsr->path);
+    free (clsr);
+    return NULL;
+}
+
+FK_LIST_BOX_ROW_SELECTED_CB (on_folder_theme_row_selected)
+{
+    const char *icon_name = fk_list_box->visible_rows[idx]->data;
+    struct icon_view_t *icon_view = g_tree_lookup (app.folder_theme_icon_names, icon_name);
     icon_view->image_data_dpy = NULL;
 
     replace_wrapped_widget (&app.icon_view_widget, draw_icon_view (icon_view));
+    app_prefetch_neighbor_rows (&app, fk_list_box, idx);
 }
 
 ITERATE_DIR_CB (dir_watch_setup_cb)
@@ -1270,9 +2369,16 @@ ITERATE_DIR_CB (folder_theme_handle_file_path)
     }
 }
 
+gboolean folder_theme_destroy_icon_view_images (gpointer key, gpointer value, gpointer data)
+{
+    icon_view_destroy_images ((struct icon_view_t *)value);
+    return FALSE;
+}
+
 gboolean folder_theme_foreach_icon_view (gpointer key, gpointer value, gpointer data)
 {
-    icon_view_compute_derived_data ((mem_pool_t*)data, (struct icon_view_t *)value);
+    icon_view_compute_derived_data ((mem_pool_t*)data, (struct icon_view_t *)value,
+                                    &app.folder_theme_generation);
     return FALSE;
 }
 
@@ -1301,6 +2407,10 @@ bool app_set_folder_theme (struct app_t *app, char *path)
     if (g_tree_nnodes (icon_views) > 0) {
         something_found = true;
 
+        // Icon views of the previous folder are freed below, drop decodes
+        // still pending for them.
+        g_atomic_int_inc (&app->folder_theme_generation);
+
         // Set the current theme to be the created folder theme
         app->selected_theme_type = THEME_TYPE_FOLDER;
         app->selected_theme = NULL; // Ignored for the Folder theme
@@ -1313,6 +2423,7 @@ bool app_set_folder_theme (struct app_t *app, char *path)
                                                         on_folder_theme_row_selected);
             fk_list_box_rows_start (app->folder_theme_fk_list_box, g_tree_nnodes(icon_views));
             g_tree_foreach (icon_views, folder_theme_row_build, app->folder_theme_fk_list_box);
+            icon_search_prepare (&app->folder_theme_search, app->folder_theme_fk_list_box, true);
             // TODO: Don't tie the lifespan of app->folder_theme_fk_list_box to
             // the new_icon_list widget, allocate everything inside app->folder_theme_pool.
             replace_wrapped_widget (&app->icon_list, new_icon_list);
@@ -1328,8 +2439,10 @@ bool app_set_folder_theme (struct app_t *app, char *path)
         }
 
         // Replace the GTree folder_theme_icon_names
-        if (app->folder_theme_icon_names != NULL)
+        if (app->folder_theme_icon_names != NULL) {
+            g_tree_foreach (app->folder_theme_icon_names, folder_theme_destroy_icon_view_images, NULL);
             g_tree_destroy (app->folder_theme_icon_names);
+        }
         app->folder_theme_icon_names = icon_views;
 
         // Replace the inotify file descriptor
@@ -1359,22 +2472,29 @@ bool app_set_folder_theme (struct app_t *app, char *path)
 
 void on_search_changed (GtkEditable *search_entry, gpointer user_data)
 {
+    struct fk_list_box_t *fk_list_box;
+    struct icon_search_t *search;
     if (app.selected_theme_type == THEME_TYPE_NORMAL) {
-        gtk_list_box_invalidate_filter (GTK_LIST_BOX(app.icon_list));
+        fk_list_box = &app.normal_theme_fk_list_box;
+        search = &app.normal_theme_search;
+
+    } else if (app.selected_theme_type == THEME_TYPE_ALL) {
+        fk_list_box = &app.all_theme_fk_list_box;
+        search = &app.all_theme_search;
 
     } else {
-        assert (app.selected_theme_type == THEME_TYPE_ALL || app.selected_theme_type == THEME_TYPE_FOLDER);
+        assert (app.selected_theme_type == THEME_TYPE_FOLDER);
+        fk_list_box = app.folder_theme_fk_list_box;
+        search = &app.folder_theme_search;
+    }
 
-        struct fk_list_box_t *fk_list_box = app.selected_theme_type == THEME_TYPE_ALL ?
-            &app.all_theme_fk_list_box : app.folder_theme_fk_list_box;
+    app_search_list (&app, search, fk_list_box, true);
+}
 
-        const gchar *search_str = gtk_entry_get_text (GTK_ENTRY(search_entry));
-        for (int i=0; i<fk_list_box->num_rows; i++) {
-            const char *icon_name = fk_list_box->rows[i].data;
-            fk_list_box->rows[i].hidden = (strstr (icon_name, search_str) == NULL);
-        }
-        fk_list_box_refresh_hidden (fk_list_box);
-    }
+void on_fuzzy_search_toggled (GtkToggleButton *button, gpointer user_data)
+{
+    app.search_fuzzy = gtk_toggle_button_get_active (button);
+    on_search_changed (GTK_EDITABLE(app.search_entry), NULL);
 }
 
 void open_folder_handler (GtkButton *button, gpointer user_data)
@@ -1406,14 +2526,6 @@ gboolean delete_callback (GtkWidget *widget, GdkEvent *event, gpointer user_data
     return FALSE;
 }
 
-gboolean all_theme_row_build (gpointer key, gpointer value, gpointer data)
-{
-    struct fk_list_box_t *fk_list_box = (struct fk_list_box_t *)data;
-    struct fk_list_box_row_t *row = fk_list_box_row_new (fk_list_box);
-    row->data = key;
-    return FALSE;
-}
-
 #define new_icon_button(icon_name,click_handler) new_icon_button_gcallback(icon_name,G_CALLBACK(click_handler))
 GtkWidget* new_icon_button_gcallback (const char *icon_name, GCallback click_handler)
 {
@@ -1423,6 +2535,7 @@ GtkWidget* new_icon_button_gcallback (const char *icon_name, GCallback click_han
     return new_button;
 }
 
+#ifndef ICONOSCOPE_NO_MAIN
 int main(int argc, char *argv[])
 {
     app = (struct app_t){
@@ -1443,12 +2556,39 @@ int main(int argc, char *argv[])
     GtkWidget *open_folder_button = new_icon_button ("document-open", open_folder_handler);
     gtk_header_bar_pack_start (GTK_HEADER_BAR(header_bar), open_folder_button);
 
+    GtkWidget *fuzzy_search_button = gtk_toggle_button_new_with_label ("Fuzzy");
+    gtk_widget_set_tooltip_text (fuzzy_search_button,
+                                 "Sort icons by how well they fuzzy match the search");
+    g_signal_connect (G_OBJECT(fuzzy_search_button), "toggled", G_CALLBACK (on_fuzzy_search_toggled), NULL);
+    gtk_header_bar_pack_end (GTK_HEADER_BAR(header_bar), fuzzy_search_button);
+
     gtk_window_set_titlebar (GTK_WINDOW(app.window), header_bar);
 
     g_signal_connect (G_OBJECT(app.window), "delete-event", G_CALLBACK (delete_callback), NULL);
     g_signal_connect (G_OBJECT(app.window), "key-press-event", G_CALLBACK (on_key_press), NULL);
 
-    app_load_all_icon_themes (&app);
+    name_table_init (&app.icon_name_table);
+    pixbuf_loader_init (&app.pixbuf_loader);
+
+    {
+        GtkIconTheme *icon_theme = gtk_icon_theme_get_default ();
+        gchar **path;
+        gint num_paths;
+        gtk_icon_theme_get_search_path (icon_theme, &path, &num_paths);
+
+#ifdef APP_LOAD_ASYNC
+        struct app_load_all_icon_themes_clsr_t *clsr = malloc (sizeof(struct app_load_all_icon_themes_clsr_t));
+        clsr->path = path;
+        clsr->num_paths = num_paths;
+        app.load_thread = g_thread_new ("theme loader", app_load_all_icon_themes_thread, clsr);
+#else
+        app_load_all_icon_themes (&app, path, num_paths);
+        for (struct icon_theme_t *theme = app.found_themes; theme; theme = theme->found_next) {
+            app_add_theme (&app, theme);
+        }
+        g_strfreev (path);
+#endif
+    }
 
     app.search_entry = gtk_search_entry_new ();
     g_signal_connect (G_OBJECT(app.search_entry), "changed", G_CALLBACK (on_search_changed), NULL);
@@ -1473,12 +2613,13 @@ int main(int argc, char *argv[])
 
     app.all_icon_names_widget = fk_list_box_init (&app.all_theme_fk_list_box,
                                                   on_all_theme_row_selected);
-    fk_list_box_rows_start (&app.all_theme_fk_list_box, g_tree_nnodes(app.all_icon_names));
-    g_tree_foreach (app.all_icon_names, all_theme_row_build, &app.all_theme_fk_list_box);
-
-    app.all_icon_names_first = app.all_theme_fk_list_box.rows[0].data;
+    app_all_theme_list_update (&app);
     g_object_ref_sink (app.all_icon_names_widget);
 
+    app.normal_theme_widget = fk_list_box_init (&app.normal_theme_fk_list_box,
+                                                on_normal_theme_row_selected);
+    g_object_ref_sink (app.normal_theme_widget);
+
     bool folder_theme_used = false;
     if (argc == 2 && dir_exists (argv[1])) {
         folder_theme_used = app_set_folder_theme (&app, argv[1]);
@@ -1497,13 +2638,22 @@ int main(int argc, char *argv[])
 
     gtk_main();
 
+    // Themes may still be loading if the window was closed early, tell the
+    // loader to stop instead of waiting for it to finish.
+    if (app.load_thread != NULL) {
+        g_atomic_int_set (&app.load_cancelled, 1);
+        g_thread_join (app.load_thread);
+    }
+
     // Not really necessary because memory will be freed anyway, but useful if
     // we ever want to run valgrind on the application. It's not freed
-    // automatically because we sunk this widget so it didn't get destroyed when
-    // it was unparented.
+    // automatically because we sunk these widgets so they didn't get destroyed when
+    // they were unparented.
     g_object_unref (app.all_icon_names_widget);
+    g_object_unref (app.normal_theme_widget);
 
     app_destroy (&app);
 
     return 0;
 }
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Read the size of an image file without decoding it.
+//
+// Only the beginning of the file is read. For PNG files that's the IHDR chunk,
+// for XPM files the values line, and for SVG files the width, height and
+// viewBox attributes of the root element. This is a lot cheaper than getting
+// a GdkPixbuf just to ask for its size, so the layout and the image data pane
+// can be computed before any image is decoded.
+//
+// Sizes of SVG files are computed the way librsvg does, with absolute units
+// converted at 90 DPI. Relative units (%, em, ex) fall back to the viewBox.
+
+#define IMAGE_PROBE_MAX_BYTES (16*1024)
+
+static inline
+uint32_t image_probe_read_u32_be (uint8_t *p)
+{
+    return (uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | (uint32_t)p[3];
+}
+
+bool image_probe_png (uint8_t *data, size_t len, int *width, int *height)
+{
+    // 8 bytes of signature, then the length and type of the first chunk,
+    // which must be IHDR and starts with the width and height.
+    static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (len < 24 || memcmp (data, signature, 8) != 0 || memcmp (data + 12, "IHDR", 4) != 0) {
+        return false;
+    }
+
+    uint32_t w = image_probe_read_u32_be (data + 16);
+    uint32_t h = image_probe_read_u32_be (data + 20);
+    if (w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX) {
+        return false;
+    }
+
+    *width = w;
+    *height = h;
+    return true;
+}
+
+bool image_probe_xpm (char *data, int *width, int *height)
+{
+    // The first string in the array is "<width> <height> <ncolors> <cpp> ...".
+    char *s = strchr (data, '{');
+    if (s == NULL || (s = strchr (s, '"')) == NULL) {
+        return false;
+    }
+
+    int w, h;
+    if (sscanf (s + 1, "%d %d", &w, &h) != 2 || w <= 0 || h <= 0) {
+        return false;
+    }
+
+    *width = w;
+    *height = h;
+    return true;
+}
+
+static inline
+bool image_probe_is_xml_space (const char *c)
+{
+    return *c == ' ' || *c == '\t' || *c == '\n' || *c == '\r';
+}
+
+// Find the value of the attribute called name in the tag that starts at tag.
+// Returns a pointer to the character after the opening quote and sets len to
+// the length of the value, or returns NULL if the attribute isn't there.
+char* image_probe_svg_attr (char *tag, char *tag_end, const char *name, size_t *len)
+{
+    size_t name_len = strlen (name);
+    char *s = tag;
+    while ((s = strstr (s, name)) != NULL && s < tag_end) {
+        char *p = s + name_len;
+        // Skip attributes that end with name, like stroke-width.
+        if (!image_probe_is_xml_space (s - 1)) {
+            s = p;
+            continue;
+        }
+
+        while (image_probe_is_xml_space (p)) p++;
+        if (*p == '=') {
+            p++;
+            while (image_probe_is_xml_space (p)) p++;
+            if (*p == '"' || *p == '\'') {
+                char *end = strchr (p + 1, *p);
+                if (end != NULL && end < tag_end) {
+                    *len = end - (p + 1);
+                    return p + 1;
+                }
+            }
+            return NULL;
+        }
+        s = p;
+    }
+    return NULL;
+}
+
+// Convert an SVG length into pixels. Returns false for relative units.
+bool image_probe_svg_length (char *value, size_t len, double *res)
+{
+    char buff[64];
+    if (len >= ARRAY_SIZE(buff)) {
+        return false;
+    }
+    memcpy (buff, value, len);
+    buff[len] = '\0';
+
+    char *unit;
+    double l = g_ascii_strtod (buff, &unit);
+    if (unit == buff || l <= 0) {
+        return false;
+    }
+    while (image_probe_is_xml_space (unit)) unit++;
+
+    double factor;
+    if (*unit == '\0' || strcmp (unit, "px") == 0) {
+        factor = 1;
+    } else if (strcmp (unit, "in") == 0) {
+        factor = 90;
+    } else if (strcmp (unit, "pt") == 0) {
+        factor = 90.0/72;
+    } else if (strcmp (unit, "pc") == 0) {
+        factor = 90.0/6;
+    } else if (strcmp (unit, "mm") == 0) {
+        factor = 90/25.4;
+    } else if (strcmp (unit, "cm") == 0) {
+        factor = 90/2.54;
+    } else {
+        return false;
+    }
+
+    *res = l*factor;
+    return true;
+}
+
+bool image_probe_svg (char *data, int *width, int *height)
+{
+    // Skip the XML declaration, comments, the doctype and processing
+    // instructions that come before the root element.
+    char *tag = strchr (data, '<');
+    while (tag != NULL && (tag[1] == '!' || tag[1] == '?')) {
+        char *end;
+        if (strncmp (tag, "<!--", 4) == 0) {
+            end = strstr (tag + 4, "-->");
+        } else {
+            end = strchr (tag, '>');
+        }
+        tag = end != NULL ? strchr (end, '<') : NULL;
+    }
+
+    if (tag == NULL || strncmp (tag, "<svg", 4) != 0 ||
+        !(image_probe_is_xml_space (tag + 4) || tag[4] == '>' || tag[4] == '/')) {
+        return false;
+    }
+
+    char *tag_end = strchr (tag, '>');
+    if (tag_end == NULL) {
+        // The root element doesn't fit in what we read.
+        return false;
+    }
+
+    double w = 0, h = 0;
+    bool has_w = false, has_h = false;
+
+    size_t len;
+    char *value;
+    if ((value = image_probe_svg_attr (tag, tag_end, "width", &len)) != NULL) {
+        has_w = image_probe_svg_length (value, len, &w);
+    }
+    if ((value = image_probe_svg_attr (tag, tag_end, "height", &len)) != NULL) {
+        has_h = image_probe_svg_length (value, len, &h);
+    }
+
+    if (!has_w || !has_h) {
+        // viewBox is "<min-x> <min-y> <width> <height>", separated by spaces
+        // or commas.
+        double vb[4];
+        value = image_probe_svg_attr (tag, tag_end, "viewBox", &len);
+        if (value == NULL) {
+            return false;
+        }
+
+        char *end = value + len;
+        char *s = value;
+        for (int i=0; i<ARRAY_SIZE(vb); i++) {
+            while (s < end && (image_probe_is_xml_space (s) || *s == ',')) s++;
+            char *num_end;
+            vb[i] = g_ascii_strtod (s, &num_end);
+            if (num_end == s || num_end > end) {
+                return false;
+            }
+            s = num_end;
+        }
+
+        if (vb[2] <= 0 || vb[3] <= 0) {
+            return false;
+        }
+
+        // Keep the aspect ratio of the viewBox if one of the sizes is there.
+        if (has_w) {
+            h = w*vb[3]/vb[2];
+        } else if (has_h) {
+            w = h*vb[2]/vb[3];
+        } else {
+            w = vb[2];
+            h = vb[3];
+        }
+    }
+
+    if (w < 0.5 || h < 0.5 || w > INT32_MAX || h > INT32_MAX) {
+        return false;
+    }
+
+    *width = (int)(w + 0.5);
+    *height = (int)(h + 0.5);
+    return true;
+}
+
+// Set width and height to the size of the image at path, and file_size to the
+// size of the file. Returns false if the file couldn't be read or its size
+// isn't known, file_size is set anyway if the file exists.
+bool image_probe (const char *path, int *width, int *height, off_t *file_size)
+{
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == 0) {
+        *file_size = st.st_size;
+    }
+
+    char data[IMAGE_PROBE_MAX_BYTES + 1];
+    ssize_t len = read (fd, data, IMAGE_PROBE_MAX_BYTES);
+    close (fd);
+    if (len <= 0) {
+        return false;
+    }
+    data[len] = '\0';
+
+    // Look at the contents instead of the extension, some themes have files
+    // that don't match their extension.
+    if ((uint8_t)data[0] == 0x89) {
+        return image_probe_png ((uint8_t*)data, len, width, height);
+    } else if (strncmp (data, "/* XPM */", 9) == 0) {
+        return image_probe_xpm (data, width, height);
+    } else {
+        return image_probe_svg (data, width, height);
+    }
+}
@@ -0,0 +1,179 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Table of interned icon names.
+//
+// Most icon names exist in several themes, instead of storing a copy of each
+// name for every theme that has it, names are stored here once and each one
+// gets a dense id starting at 0. Themes then only need a bitset over these ids
+// (see struct name_set_t) to know which icons they have.
+//
+// name_table_intern() and name_table_lookup() can be called concurrently from
+// several threads. Ids and name pointers never change once assigned, so
+// name_table_get() doesn't lock, it can be called with any id that was
+// returned by the other functions.
+
+#define NAME_TABLE_CHUNK_SIZE 4096
+#define NAME_TABLE_MAX_CHUNKS 1024
+
+struct name_table_t {
+    GMutex lock;
+    mem_pool_t pool;
+    GHashTable *ids; // Maps names to their id plus 1
+
+    // Names indexed by id, they are stored in fixed size chunks so existing
+    // entries don't move when we need more space.
+    uint32_t num_names;
+    char **chunks[NAME_TABLE_MAX_CHUNKS];
+};
+
+void name_table_init (struct name_table_t *table)
+{
+    *table = ZERO_INIT (struct name_table_t);
+    g_mutex_init (&table->lock);
+    table->ids = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+void name_table_destroy (struct name_table_t *table)
+{
+    for (int i=0; i<NAME_TABLE_MAX_CHUNKS && table->chunks[i] != NULL; i++) {
+        free (table->chunks[i]);
+    }
+    g_hash_table_destroy (table->ids);
+    mem_pool_destroy (&table->pool);
+    g_mutex_clear (&table->lock);
+}
+
+static inline
+char* name_table_get (struct name_table_t *table, uint32_t id)
+{
+    return table->chunks[id/NAME_TABLE_CHUNK_SIZE][id%NAME_TABLE_CHUNK_SIZE];
+}
+
+// Get the ids of all num_names names in names, names not yet in the table are
+// added. The lock is only taken once so this is better than interning names
+// one by one.
+void name_table_intern (struct name_table_t *table, char **names, uint32_t num_names, uint32_t *ids)
+{
+    g_mutex_lock (&table->lock);
+    for (uint32_t i=0; i<num_names; i++) {
+        gpointer value = g_hash_table_lookup (table->ids, names[i]);
+        if (value != NULL) {
+            ids[i] = GPOINTER_TO_UINT (value) - 1;
+
+        } else {
+            uint32_t id = table->num_names;
+            uint32_t chunk = id/NAME_TABLE_CHUNK_SIZE;
+            assert (chunk < NAME_TABLE_MAX_CHUNKS && "Too many icon names");
+            if (table->chunks[chunk] == NULL) {
+                table->chunks[chunk] = malloc (NAME_TABLE_CHUNK_SIZE*sizeof(char*));
+            }
+
+            char *name = pom_strdup (&table->pool, names[i]);
+            table->chunks[chunk][id%NAME_TABLE_CHUNK_SIZE] = name;
+            g_hash_table_insert (table->ids, name, GUINT_TO_POINTER (id + 1));
+
+            table->num_names++;
+            ids[i] = id;
+        }
+    }
+    g_mutex_unlock (&table->lock);
+}
+
+// Returns false if name was never interned.
+bool name_table_lookup (struct name_table_t *table, const char *name, uint32_t *id)
+{
+    g_mutex_lock (&table->lock);
+    gpointer value = g_hash_table_lookup (table->ids, name);
+    g_mutex_unlock (&table->lock);
+
+    if (value != NULL) {
+        *id = GPOINTER_TO_UINT (value) - 1;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+// Set of name ids, stored as a bitset. After all ids have been added,
+// name_set_compute_rank() must be called. Then the set can be used to map each
+// id in the set to its position in the set (its rank), in constant time. This
+// is useful to store arrays of data parallel to the ids in the set.
+struct name_set_t {
+    uint32_t num_words;
+    uint64_t *bits;
+
+    // Number of ids in the set, and number of ids in all words before each one.
+    uint32_t count;
+    uint32_t *rank;
+};
+
+// Create an empty set that can hold ids smaller than num_ids. Memory is
+// allocated from pool.
+void name_set_init (mem_pool_t *pool, struct name_set_t *set, uint32_t num_ids)
+{
+    *set = ZERO_INIT (struct name_set_t);
+    set->num_words = (num_ids + 63)/64;
+    if (set->num_words > 0) {
+        set->bits = pom_push_array (pool, set->num_words, uint64_t);
+        memset (set->bits, 0, set->num_words*sizeof(uint64_t));
+        set->rank = pom_push_array (pool, set->num_words, uint32_t);
+    }
+}
+
+static inline
+void name_set_add (struct name_set_t *set, uint32_t id)
+{
+    assert (id/64 < set->num_words);
+    set->bits[id/64] |= (uint64_t)1 << (id%64);
+}
+
+static inline
+bool name_set_contains (struct name_set_t *set, uint32_t id)
+{
+    return id/64 < set->num_words && (set->bits[id/64] & ((uint64_t)1 << (id%64))) != 0;
+}
+
+void name_set_compute_rank (struct name_set_t *set)
+{
+    uint32_t count = 0;
+    for (uint32_t i=0; i<set->num_words; i++) {
+        set->rank[i] = count;
+        count += __builtin_popcountll (set->bits[i]);
+    }
+    set->count = count;
+}
+
+// Position of id among all the ids in the set, id must be in the set.
+static inline
+uint32_t name_set_rank (struct name_set_t *set, uint32_t id)
+{
+    uint64_t lower_bits = set->bits[id/64] & (((uint64_t)1 << (id%64)) - 1);
+    return set->rank[id/64] + __builtin_popcountll (lower_bits);
+}
+
+// Iterate ids in the set in increasing order:
+//
+//   int64_t id = -1;
+//   while ((id = name_set_next (set, id)) != -1) {
+//       ...
+//   }
+int64_t name_set_next (struct name_set_t *set, int64_t id)
+{
+    uint64_t start = id + 1;
+    uint32_t word = start/64;
+    if (word >= set->num_words) {
+        return -1;
+    }
+
+    uint64_t bits = set->bits[word] & (~(uint64_t)0 << (start%64));
+    while (bits == 0) {
+        word++;
+        if (word >= set->num_words) {
+            return -1;
+        }
+        bits = set->bits[word];
+    }
+    return (int64_t)word*64 + __builtin_ctzll (bits);
+}
@@ -0,0 +1,481 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Decode image files into GdkPixbufs in a pool of worker threads.
+//
+// Each request has a generation, a counter owned by whoever made the request
+// together with the value it had at that time. Incrementing the counter makes
+// all pending requests of that owner stale. Stale requests that haven't
+// started are skipped, and the results of the ones that were already running
+// are dropped, so the callback is never called with data that may have been
+// freed. Callbacks are called from the main loop.
+//
+// Requests are processed in the order they were made, except for prefetch
+// requests which wait until there are no other ones pending. Prefetches don't
+// have a callback, they only fill the cache.
+//
+// Decoded pixbufs are kept in a cache with a budget of PIXBUF_CACHE_MAX_BYTES,
+// when it's full the least recently used ones are evicted. Entries are keyed
+// by requested size and path, and store the modification time of the file
+// they were decoded from. Files are never stat()ed in the main thread, every
+// request goes to a worker that stat()s the file first. If the cache had the
+// file when the request was made and it didn't change, the worker doesn't
+// decode it and the cached pixbuf is used when the request finishes. These
+// requests are processed before any other, they are cheap.
+//
+// Results of stale requests still go into the cache, they were expensive to
+// compute and the user is likely to come back to them.
+
+#define PIXBUF_LOADER_DONE_CB(name) void name(GdkPixbuf *pixbuf, off_t file_size, void *data)
+typedef PIXBUF_LOADER_DONE_CB(pixbuf_loader_done_cb_t);
+
+#define PIXBUF_CACHE_MAX_BYTES (64*1024*1024)
+
+// If defined, hit and eviction counts of the pixbuf cache are printed to
+// stdout when the application exits. Useful when tuning
+// PIXBUF_CACHE_MAX_BYTES.
+//#define PIXBUF_CACHE_PRINT_STATS
+
+struct pixbuf_cache_entry_t {
+    char *key;
+    GdkPixbuf *pixbuf;
+    size_t bytes;
+
+    struct timespec mtime;
+    off_t file_size;
+
+    // Entries sorted from most to least recently used.
+    struct pixbuf_cache_entry_t *prev;
+    struct pixbuf_cache_entry_t *next;
+};
+
+// Only used from the main thread.
+struct pixbuf_cache_t {
+    GHashTable *entries;
+    struct pixbuf_cache_entry_t *first;
+    struct pixbuf_cache_entry_t *last;
+    size_t bytes;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct pixbuf_loader_t {
+    GThreadPool *pool;
+    struct pixbuf_cache_t cache;
+    uint64_t next_seq;
+
+    // Number of requests in the pool for each cache key. Only used from the
+    // main thread.
+    GHashTable *pending;
+
+    // Requests finished by the workers, waiting for pixbuf_loader_done() to
+    // run in the main loop. done_source is the idle source that will run it,
+    // or 0 if there is none.
+    GMutex done_lock;
+    struct pixbuf_load_t *done_first;
+    struct pixbuf_load_t *done_last;
+    guint done_source;
+
+    // Set when the loader is being destroyed, workers skip the remaining
+    // requests.
+    gint shutting_down;
+};
+
+struct pixbuf_load_t {
+    struct pixbuf_loader_t *loader;
+    uint64_t seq;
+    bool is_prefetch;
+
+    char *path;
+    int size;
+    char *cache_key;
+
+    // Set if the cache had the file when the request was made, to the
+    // modification time of the cached pixbuf.
+    bool has_cached;
+    struct timespec cached_mtime;
+
+    gint *generation;
+    gint expected_generation;
+
+    pixbuf_loader_done_cb_t *cb; // NULL for prefetches
+    void *cb_data;
+
+    // Result. has_stat is false if the file couldn't be stat()ed. If
+    // use_cached is true the file didn't change and wasn't decoded, otherwise
+    // pixbuf is NULL if the file couldn't be decoded.
+    bool has_stat;
+    struct timespec mtime;
+    off_t file_size;
+    bool use_cached;
+    GdkPixbuf *pixbuf;
+
+    struct pixbuf_load_t *done_next;
+};
+
+void pixbuf_cache_init (struct pixbuf_cache_t *cache)
+{
+    *cache = ZERO_INIT (struct pixbuf_cache_t);
+    cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+}
+
+void pixbuf_cache_remove (struct pixbuf_cache_t *cache, struct pixbuf_cache_entry_t *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->first = entry->next;
+    }
+
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->last = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+void pixbuf_cache_push_first (struct pixbuf_cache_t *cache, struct pixbuf_cache_entry_t *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->first;
+    if (cache->first != NULL) {
+        cache->first->prev = entry;
+    } else {
+        cache->last = entry;
+    }
+    cache->first = entry;
+}
+
+void pixbuf_cache_entry_destroy (struct pixbuf_cache_t *cache, struct pixbuf_cache_entry_t *entry)
+{
+    pixbuf_cache_remove (cache, entry);
+    g_hash_table_remove (cache->entries, entry->key);
+    cache->bytes -= entry->bytes;
+
+    g_object_unref (entry->pixbuf);
+    free (entry->key);
+    free (entry);
+}
+
+void pixbuf_cache_destroy (struct pixbuf_cache_t *cache)
+{
+    while (cache->first != NULL) {
+        pixbuf_cache_entry_destroy (cache, cache->first);
+    }
+    if (cache->entries != NULL) {
+        g_hash_table_destroy (cache->entries);
+    }
+    *cache = ZERO_INIT (struct pixbuf_cache_t);
+}
+
+static inline
+bool timespec_equal (struct timespec *a, struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Returns the entry for key if it was decoded from a file modified at mtime,
+// or NULL. The cache keeps ownership of it.
+struct pixbuf_cache_entry_t* pixbuf_cache_lookup (struct pixbuf_cache_t *cache, const char *key,
+                                                  struct timespec *mtime)
+{
+    struct pixbuf_cache_entry_t *entry = g_hash_table_lookup (cache->entries, key);
+    if (entry == NULL || !timespec_equal (&entry->mtime, mtime)) {
+        return NULL;
+    }
+
+    pixbuf_cache_remove (cache, entry);
+    pixbuf_cache_push_first (cache, entry);
+    return entry;
+}
+
+// Takes a new reference to pixbuf, an entry for the same key decoded from an
+// older version of the file is replaced. Pixbufs bigger than the whole budget
+// aren't cached.
+void pixbuf_cache_insert (struct pixbuf_cache_t *cache, const char *key,
+                          struct timespec *mtime, off_t file_size, GdkPixbuf *pixbuf)
+{
+    size_t bytes = (size_t)gdk_pixbuf_get_rowstride (pixbuf)*gdk_pixbuf_get_height (pixbuf);
+    if (bytes > PIXBUF_CACHE_MAX_BYTES) {
+        return;
+    }
+
+    struct pixbuf_cache_entry_t *old = g_hash_table_lookup (cache->entries, key);
+    if (old != NULL) {
+        if (timespec_equal (&old->mtime, mtime)) {
+            return;
+        }
+        pixbuf_cache_entry_destroy (cache, old);
+    }
+
+    while (cache->bytes + bytes > PIXBUF_CACHE_MAX_BYTES) {
+        pixbuf_cache_entry_destroy (cache, cache->last);
+        cache->evictions++;
+    }
+
+    struct pixbuf_cache_entry_t *entry = malloc (sizeof(struct pixbuf_cache_entry_t));
+    *entry = ZERO_INIT (struct pixbuf_cache_entry_t);
+    entry->key = strdup (key);
+    entry->pixbuf = g_object_ref (pixbuf);
+    entry->bytes = bytes;
+    entry->mtime = *mtime;
+    entry->file_size = file_size;
+    g_hash_table_insert (cache->entries, entry->key, entry);
+    pixbuf_cache_push_first (cache, entry);
+    cache->bytes += bytes;
+}
+
+void pixbuf_cache_print_stats (struct pixbuf_cache_t *cache)
+{
+    uint64_t lookups = cache->hits + cache->misses;
+    printf ("Pixbuf cache: %"PRIu64" hits, %"PRIu64" misses (%.1f%% hit rate), "
+            "%"PRIu64" evictions, %u pixbufs using %zu KiB\n",
+            cache->hits, cache->misses, lookups > 0 ? 100.0*cache->hits/lookups : 0.0,
+            cache->evictions, g_hash_table_size (cache->entries), cache->bytes/1024);
+}
+
+static inline
+bool pixbuf_load_is_stale (struct pixbuf_load_t *load)
+{
+    return g_atomic_int_get (load->generation) != load->expected_generation;
+}
+
+void pixbuf_loader_push_load (struct pixbuf_loader_t *loader, struct pixbuf_load_t *load);
+
+void pixbuf_load_free (struct pixbuf_load_t *load)
+{
+    if (load->pixbuf != NULL) {
+        g_object_unref (load->pixbuf);
+    }
+    g_free (load->cache_key);
+    free (load->path);
+    free (load);
+}
+
+// Runs in the main thread.
+void pixbuf_load_finish (struct pixbuf_load_t *load)
+{
+    struct pixbuf_loader_t *loader = load->loader;
+
+    uint32_t num_pending = GPOINTER_TO_UINT (g_hash_table_lookup (loader->pending, load->cache_key));
+    if (num_pending > 1) {
+        g_hash_table_insert (loader->pending, g_strdup (load->cache_key), GUINT_TO_POINTER (num_pending - 1));
+    } else {
+        g_hash_table_remove (loader->pending, load->cache_key);
+    }
+
+    GdkPixbuf *pixbuf = load->pixbuf;
+    off_t file_size = load->file_size;
+    if (load->use_cached) {
+        struct pixbuf_cache_entry_t *entry =
+            pixbuf_cache_lookup (&loader->cache, load->cache_key, &load->mtime);
+        if (entry == NULL) {
+            // The entry was evicted while the file was stat()ed, decode it.
+            load->has_cached = false;
+            load->use_cached = false;
+            pixbuf_loader_push_load (loader, load);
+            return;
+        }
+        pixbuf = entry->pixbuf;
+        file_size = entry->file_size;
+
+    } else if (load->pixbuf != NULL && load->has_stat) {
+        pixbuf_cache_insert (&loader->cache, load->cache_key, &load->mtime, load->file_size, load->pixbuf);
+    }
+
+    if (load->cb != NULL && !pixbuf_load_is_stale (load)) {
+        if (load->use_cached) {
+            loader->cache.hits++;
+        } else {
+            loader->cache.misses++;
+        }
+        load->cb (pixbuf, file_size, load->cb_data);
+    }
+
+    pixbuf_load_free (load);
+}
+
+// Runs in the main thread.
+gboolean pixbuf_loader_done (gpointer data)
+{
+    struct pixbuf_loader_t *loader = (struct pixbuf_loader_t*)data;
+
+    g_mutex_lock (&loader->done_lock);
+    struct pixbuf_load_t *load = loader->done_first;
+    loader->done_first = NULL;
+    loader->done_last = NULL;
+    loader->done_source = 0;
+    g_mutex_unlock (&loader->done_lock);
+
+    while (load != NULL) {
+        struct pixbuf_load_t *next = load->done_next;
+        pixbuf_load_finish (load);
+        load = next;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Runs in a worker thread.
+void pixbuf_load_run (gpointer data, gpointer user_data)
+{
+    struct pixbuf_load_t *load = (struct pixbuf_load_t*)data;
+    struct pixbuf_loader_t *loader = load->loader;
+    if (!pixbuf_load_is_stale (load) && !g_atomic_int_get (&loader->shutting_down)) {
+        struct stat st;
+        if (stat (load->path, &st) == 0) {
+            load->has_stat = true;
+            load->mtime = st.st_mtim;
+            load->file_size = st.st_size;
+        }
+
+        if (load->has_stat && load->has_cached && timespec_equal (&load->mtime, &load->cached_mtime)) {
+            load->use_cached = true;
+
+        } else if (load->size > 0) {
+            load->pixbuf = gdk_pixbuf_new_from_file_at_size (load->path, load->size, load->size, NULL);
+        } else {
+            load->pixbuf = gdk_pixbuf_new_from_file (load->path, NULL);
+        }
+    }
+
+    load->done_next = NULL;
+    g_mutex_lock (&loader->done_lock);
+    if (loader->done_last != NULL) {
+        loader->done_last->done_next = load;
+    } else {
+        loader->done_first = load;
+    }
+    loader->done_last = load;
+    if (loader->done_source == 0) {
+        loader->done_source = g_idle_add (pixbuf_loader_done, loader);
+    }
+    g_mutex_unlock (&loader->done_lock);
+}
+
+gint pixbuf_load_cmp (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    struct pixbuf_load_t *load_a = (struct pixbuf_load_t*)a;
+    struct pixbuf_load_t *load_b = (struct pixbuf_load_t*)b;
+    if (load_a->is_prefetch != load_b->is_prefetch) {
+        return load_a->is_prefetch ? 1 : -1;
+    }
+    if (load_a->has_cached != load_b->has_cached) {
+        return load_a->has_cached ? -1 : 1;
+    }
+    return load_a->seq < load_b->seq ? -1 : (load_a->seq > load_b->seq ? 1 : 0);
+}
+
+void pixbuf_loader_init (struct pixbuf_loader_t *loader)
+{
+    *loader = ZERO_INIT (struct pixbuf_loader_t);
+    loader->pool = g_thread_pool_new (pixbuf_load_run, NULL, g_get_num_processors (), FALSE, NULL);
+    g_thread_pool_set_sort_function (loader->pool, pixbuf_load_cmp, NULL);
+    loader->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_mutex_init (&loader->done_lock);
+    pixbuf_cache_init (&loader->cache);
+}
+
+// Callbacks of unfinished requests are never called. Requests that haven't
+// started are not decoded, this waits only for the ones that are running.
+void pixbuf_loader_destroy (struct pixbuf_loader_t *loader)
+{
+    if (loader->pool == NULL) {
+        return;
+    }
+
+    g_atomic_int_set (&loader->shutting_down, 1);
+    g_thread_pool_free (loader->pool, FALSE, TRUE);
+
+    // All requests are now in the done list.
+    if (loader->done_source != 0) {
+        g_source_remove (loader->done_source);
+    }
+    struct pixbuf_load_t *load = loader->done_first;
+    while (load != NULL) {
+        struct pixbuf_load_t *next = load->done_next;
+        pixbuf_load_free (load);
+        load = next;
+    }
+
+    g_mutex_clear (&loader->done_lock);
+    g_hash_table_destroy (loader->pending);
+    pixbuf_cache_destroy (&loader->cache);
+    *loader = ZERO_INIT (struct pixbuf_loader_t);
+}
+
+// Returns the key of the image at path scaled to size in the cache. The
+// caller must g_free() it.
+char* pixbuf_cache_key (const char *path, int size)
+{
+    return g_strdup_printf ("%d:%s", size, path);
+}
+
+void pixbuf_loader_push_load (struct pixbuf_loader_t *loader, struct pixbuf_load_t *load)
+{
+    uint32_t num_pending = GPOINTER_TO_UINT (g_hash_table_lookup (loader->pending, load->cache_key));
+    g_hash_table_insert (loader->pending, g_strdup (load->cache_key), GUINT_TO_POINTER (num_pending + 1));
+
+    g_thread_pool_push (loader->pool, load, NULL);
+}
+
+// Takes ownership of cache_key.
+void pixbuf_loader_push (struct pixbuf_loader_t *loader, const char *path, int size,
+                         char *cache_key, gint *generation,
+                         pixbuf_loader_done_cb_t *cb, void *cb_data)
+{
+    struct pixbuf_load_t *load = malloc (sizeof(struct pixbuf_load_t));
+    *load = ZERO_INIT (struct pixbuf_load_t);
+    load->loader = loader;
+    load->seq = loader->next_seq++;
+    load->is_prefetch = cb == NULL;
+    load->path = strdup (path);
+    load->size = size;
+    load->cache_key = cache_key;
+    load->generation = generation;
+    load->expected_generation = g_atomic_int_get (generation);
+    load->cb = cb;
+    load->cb_data = cb_data;
+
+    struct pixbuf_cache_entry_t *entry = g_hash_table_lookup (loader->cache.entries, cache_key);
+    if (entry != NULL) {
+        load->has_cached = true;
+        load->cached_mtime = entry->mtime;
+    }
+
+    pixbuf_loader_push_load (loader, load);
+}
+
+// Decode the image at path and call cb with the result from the main loop,
+// unless *generation changed before that. If size is larger than 0 the image
+// is scaled to fit in a square of that size, otherwise it keeps its natural
+// size. If the image is in the cache and the file didn't change, cb gets the
+// cached pixbuf without decoding the file again. The callback doesn't own the
+// pixbuf, it must take a reference to keep it.
+void pixbuf_loader_request (struct pixbuf_loader_t *loader, const char *path, int size,
+                            gint *generation, pixbuf_loader_done_cb_t *cb, void *cb_data)
+{
+    pixbuf_loader_push (loader, path, size, pixbuf_cache_key (path, size), generation, cb, cb_data);
+}
+
+// Decode the image at path into the cache, so a later pixbuf_loader_request()
+// for it doesn't have to. Nothing is done if the cache already has the image,
+// even if the file changed since then, or if there is a request for it in the
+// pool. Prefetches don't count as cache lookups in the statistics.
+void pixbuf_loader_prefetch (struct pixbuf_loader_t *loader, const char *path, int size,
+                             gint *generation)
+{
+    char *cache_key = pixbuf_cache_key (path, size);
+    if (g_hash_table_contains (loader->cache.entries, cache_key) ||
+        g_hash_table_contains (loader->pending, cache_key)) {
+        g_free (cache_key);
+        return;
+    }
+
+    pixbuf_loader_push (loader, path, size, cache_key, generation, NULL, NULL);
+}
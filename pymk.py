@@ -32,6 +32,9 @@ def default():
 def iconoscope ():
     ex ('gcc {FLAGS} -o bin/iconoscope iconoscope.c {GTK_FLAGS} -lm')
 
+def search_benchmark ():
+    ex ('gcc {FLAGS} -o bin/search_benchmark search_benchmark.c {GTK_FLAGS} -lm')
+
 def install ():
     dest_dir = get_cli_option ('--destdir', has_argument=True)
     installed_files = install_files (installation_info, dest_dir)
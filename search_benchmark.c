@@ -0,0 +1,120 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Time the search matchers over the names of all installed icons. Queries can
+// be passed as arguments, otherwise a default set is used.
+//
+// This includes the same sources as the application, but without its main(),
+// so it's built separately with './pymk.py search_benchmark'.
+
+#define ICONOSCOPE_NO_MAIN
+#include "iconoscope.c"
+
+// Compare the time it takes to find the names that contain each query using a
+// strstr() loop over names, and using the matchers over the same names packed
+// into a buffer.
+void icon_search_benchmark (char **names, uint32_t num_names, char **queries, int num_queries)
+{
+    char *default_queries[] = {"a", "go", "edit", "-symbolic", "media-playback"};
+    if (num_queries == 0) {
+        queries = default_queries;
+        num_queries = ARRAY_SIZE(default_queries);
+    }
+
+    struct {
+        const char *name;
+        packed_names_match_func_t *func;
+    } matchers[] = {
+        {"packed scalar", packed_names_match_scalar},
+#ifdef ICON_SEARCH_SIMD
+        {"packed SSE2", packed_names_match_sse2},
+        {"packed AVX2", packed_names_match_avx2},
+#endif
+    };
+
+    int num_matchers = ARRAY_SIZE(matchers);
+#ifdef ICON_SEARCH_SIMD
+    __builtin_cpu_init ();
+    if (!__builtin_cpu_supports ("avx2")) {
+        num_matchers--;
+    }
+#endif
+
+    struct packed_names_t packed;
+    packed_names_build (&packed, names, num_names);
+    uint32_t *matches = malloc (MAX(num_names, 1)*sizeof(uint32_t));
+
+    int num_iterations = 100;
+    printf ("Searching %"PRIu32" names (%zu bytes), %d iterations per query\n",
+            num_names, packed.len, num_iterations);
+
+    for (int i=0; i<num_queries; i++) {
+        size_t query_len = strlen (queries[i]);
+        if (query_len == 0) continue;
+
+        struct timespec start, end;
+        uint32_t num_matches = 0;
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        for (int it=0; it<num_iterations; it++) {
+            num_matches = 0;
+            for (uint32_t j=0; j<num_names; j++) {
+                if (strstr (names[j], queries[i]) != NULL) {
+                    matches[num_matches++] = j;
+                }
+            }
+        }
+        clock_gettime (CLOCK_MONOTONIC, &end);
+
+        printf ("\n'%s' (%"PRIu32" matches)\n", queries[i], num_matches);
+        printf ("  %-14s %10.4f ms\n", "strstr loop", time_elapsed_in_ms (&start, &end)/num_iterations);
+
+        for (int m=0; m<num_matchers; m++) {
+            uint32_t num_matcher_matches = 0;
+            clock_gettime (CLOCK_MONOTONIC, &start);
+            for (int it=0; it<num_iterations; it++) {
+                num_matcher_matches = matchers[m].func (&packed, queries[i], query_len, matches);
+            }
+            clock_gettime (CLOCK_MONOTONIC, &end);
+
+            printf ("  %-14s %10.4f ms%s\n", matchers[m].name,
+                    time_elapsed_in_ms (&start, &end)/num_iterations,
+                    num_matcher_matches != num_matches ? " (WRONG RESULT)" : "");
+        }
+    }
+
+    free (matches);
+    packed_names_destroy (&packed);
+}
+
+int main (int argc, char *argv[])
+{
+    app = (struct app_t){
+#define EXTENSION(name,str) str,
+        .valid_extensions = { VALID_EXTENSIONS }
+#undef EXTENSION
+    };
+
+    gtk_init (&argc, &argv);
+
+    name_table_init (&app.icon_name_table);
+    pixbuf_loader_init (&app.pixbuf_loader);
+
+    GtkIconTheme *icon_theme = gtk_icon_theme_get_default ();
+    gchar **path;
+    gint num_paths;
+    gtk_icon_theme_get_search_path (icon_theme, &path, &num_paths);
+    app_load_all_icon_themes (&app, path, num_paths);
+    g_strfreev (path);
+
+    uint32_t num_names = app.icon_name_table.num_names;
+    char **names = malloc (MAX(num_names, 1)*sizeof(char*));
+    for (uint32_t i=0; i<num_names; i++) {
+        names[i] = name_table_get (&app.icon_name_table, i);
+    }
+    icon_search_benchmark (names, num_names, argv + 1, argc - 1);
+
+    free (names);
+    app_destroy (&app);
+    return 0;
+}
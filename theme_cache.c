@@ -0,0 +1,746 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+// Persistent cache of the scanned icon database.
+//
+// The directory cache avoids listing directories that didn't change, but with
+// only that, every start would still read and parse all index.theme files,
+// intern all icon names, sort them, and build their postings and facets. To
+// avoid this, once all themes are loaded, the tables of each theme are written
+// into a binary file. The next time the application starts, a theme found in
+// the same directories is restored from this file instead of being scanned.
+//
+// A theme is built from its index.theme file, its base directories, their
+// icon-theme.cache files, and the directories of its sections. These are the
+// dependencies of the theme (see struct theme_dep_t), we store their
+// modification time from before the theme was scanned, or the fact that they
+// didn't exist. A stored theme is only used if calling stat() on all its
+// dependencies gives the same result.
+//
+// The layout of the file is the following (all integers are in native byte
+// order):
+//
+//   struct theme_cache_header_t   header;
+//   struct theme_cache_dep_t      deps[header.num_deps];
+//   uint64_t                      facet_words[header.num_facet_words];
+//   struct theme_cache_theme_t    themes[header.num_themes];  // sorted by key
+//   struct theme_cache_section_t  sections[header.num_sections];
+//   struct theme_cache_facet_t    facets[header.num_facets];
+//   uint32_t                      strs[header.num_strs];      // dirs and inherits
+//   struct theme_cache_icon_t     icons[header.num_icons];
+//   struct icon_location_t        locations[header.num_locations];
+//   char                          strings[header.strings_size];
+//
+// All strings are null terminated and referenced by their offset into the
+// strings section, equal strings are stored once. Themes are sorted by their
+// directory name and then by the path of their index.theme file, both are ""
+// for the theme of unthemed icons.
+
+#define THEME_CACHE_MAGIC "ICTC"
+#define THEME_CACHE_VERSION 1
+
+#define THEME_CACHE_NONE 0xFFFFFFFF
+
+// NOTE: The size of the header must be a multiple of 8 so the 64 bit fields of
+// the dependencies and facet words that follow it are aligned in the mapped
+// file.
+struct theme_cache_header_t {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_themes;
+    uint32_t num_deps;
+    uint32_t num_facet_words;
+    uint32_t num_sections;
+    uint32_t num_facets;
+    uint32_t num_strs;
+    uint32_t num_icons;
+    uint32_t num_locations;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+
+struct theme_cache_dep_t {
+    uint32_t path;
+    uint32_t exists;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+// Each facet of a theme has (num_icons + 63)/64 words starting at
+// first_facet_word, facets are stored one after the other.
+struct theme_cache_theme_t {
+    uint32_t dir_name;
+    uint32_t index_fname;
+    uint32_t name;
+    uint32_t first_dep;
+    uint32_t num_deps;
+    uint32_t first_dir;
+    uint32_t num_dirs;
+    uint32_t first_inherit;
+    uint32_t num_inherits;
+    uint32_t first_section;
+    uint32_t num_sections;
+    uint32_t first_icon;
+    uint32_t num_icons;
+    uint32_t first_location;
+    uint32_t num_locations;
+    uint32_t first_facet;
+    uint32_t num_facets;
+    uint32_t first_facet_word;
+};
+
+// type and context are THEME_CACHE_NONE if the section doesn't have them.
+struct theme_cache_section_t {
+    uint32_t name;
+    uint32_t type;
+    uint32_t context;
+    int32_t size;
+    int32_t min_size;
+    int32_t max_size;
+    int32_t scale;
+    int32_t threshold;
+    uint32_t is_scalable;
+    uint32_t reserved;
+};
+
+struct theme_cache_facet_t {
+    uint32_t type;
+    uint32_t value;
+};
+
+// Icons of a theme are stored in the order of sorted_icon_names, the
+// locations of each one follow the ones of the previous icon.
+struct theme_cache_icon_t {
+    uint32_t name;
+    uint32_t num_locations;
+};
+
+struct theme_cache_t {
+    char *fname;
+
+    // Mapped cache file, NULL if there was no valid one.
+    void *map;
+    size_t map_size;
+    struct theme_cache_header_t *header;
+    struct theme_cache_dep_t *deps;
+    uint64_t *facet_words;
+    struct theme_cache_theme_t *themes;
+    struct theme_cache_section_t *sections;
+    struct theme_cache_facet_t *facets;
+    uint32_t *strs;
+    struct theme_cache_icon_t *icons;
+    struct icon_location_t *locations;
+    char *strings;
+
+    // Number of themes restored by theme_cache_restore(), if all stored themes
+    // were restored and no other theme was found, the file isn't written again.
+    uint32_t num_restored;
+};
+
+void theme_cache_init (struct theme_cache_t *cache, const char *fname)
+{
+    *cache = ZERO_INIT (struct theme_cache_t);
+    cache->fname = strdup (fname);
+
+    int fd = open (fname, O_RDONLY);
+    if (fd == -1) {
+        // NOTE: Not having a cache file is normal on the first run.
+        return;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat (fd, &st) == 0 && st.st_size >= sizeof(struct theme_cache_header_t)) {
+        map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close (fd);
+
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    struct theme_cache_header_t *header = (struct theme_cache_header_t*)map;
+    size_t expected_size = sizeof(struct theme_cache_header_t) +
+                           (size_t)header->num_deps*sizeof(struct theme_cache_dep_t) +
+                           (size_t)header->num_facet_words*sizeof(uint64_t) +
+                           (size_t)header->num_themes*sizeof(struct theme_cache_theme_t) +
+                           (size_t)header->num_sections*sizeof(struct theme_cache_section_t) +
+                           (size_t)header->num_facets*sizeof(struct theme_cache_facet_t) +
+                           (size_t)header->num_strs*sizeof(uint32_t) +
+                           (size_t)header->num_icons*sizeof(struct theme_cache_icon_t) +
+                           (size_t)header->num_locations*sizeof(struct icon_location_t) +
+                           header->strings_size;
+
+    if (memcmp (header->magic, THEME_CACHE_MAGIC, 4) != 0 ||
+        header->version != THEME_CACHE_VERSION ||
+        expected_size != st.st_size ||
+        header->strings_size == 0 ||
+        ((char*)map)[st.st_size-1] != '\0') {
+        printf ("Ignoring invalid theme cache: %s\n", fname);
+        munmap (map, st.st_size);
+        return;
+    }
+
+    cache->map = map;
+    cache->map_size = st.st_size;
+    cache->header = header;
+    cache->deps = (struct theme_cache_dep_t*)(header + 1);
+    cache->facet_words = (uint64_t*)(cache->deps + header->num_deps);
+    cache->themes = (struct theme_cache_theme_t*)(cache->facet_words + header->num_facet_words);
+    cache->sections = (struct theme_cache_section_t*)(cache->themes + header->num_themes);
+    cache->facets = (struct theme_cache_facet_t*)(cache->sections + header->num_sections);
+    cache->strs = (uint32_t*)(cache->facets + header->num_facets);
+    cache->icons = (struct theme_cache_icon_t*)(cache->strs + header->num_strs);
+    cache->locations = (struct icon_location_t*)(cache->icons + header->num_icons);
+    cache->strings = (char*)(cache->locations + header->num_locations);
+}
+
+void theme_cache_destroy (struct theme_cache_t *cache)
+{
+    if (cache->map != NULL) {
+        munmap (cache->map, cache->map_size);
+    }
+    free (cache->fname);
+    *cache = ZERO_INIT (struct theme_cache_t);
+}
+
+// Returns NULL if offset is outside of the strings section.
+static inline
+char* theme_cache_str (struct theme_cache_t *cache, uint32_t offset)
+{
+    return offset < cache->header->strings_size ? cache->strings + offset : NULL;
+}
+
+static inline
+bool theme_cache_range_ok (uint32_t first, uint64_t num, uint32_t total)
+{
+    return first + num <= total;
+}
+
+static inline
+void theme_dep_stat (const char *path, bool *exists, struct timespec *mtime)
+{
+    struct stat st;
+    *exists = stat (path, &st) == 0;
+    *mtime = *exists ? st.st_mtim : ZERO_INIT (struct timespec);
+}
+
+static inline
+void theme_deps_add (struct icon_theme_t *theme, const char *path)
+{
+    struct theme_dep_t *dep = &theme->deps[theme->num_deps++];
+    dep->path = pom_strdup (&theme->pool, path);
+    theme_dep_stat (path, &dep->exists, &dep->mtime);
+}
+
+// Stat all dependencies of theme and store them in theme->deps. This must be
+// called after the index file is parsed, and before the theme is scanned, so
+// that anything that changes while scanning makes the stored theme invalid.
+void theme_deps_compute (struct icon_theme_t *theme)
+{
+    // NOTE: The array is allocated before the paths so it's aligned.
+    uint32_t max_deps = theme->num_dirs;
+    if (theme->dir_name != NULL) {
+        max_deps += 1 + theme->num_dirs*(1 + theme->num_sections);
+    }
+    theme->deps = pom_push_array (&theme->pool, MAX(max_deps, 1), struct theme_dep_t);
+    theme->num_deps = 0;
+
+    if (theme->dir_name != NULL) {
+        theme_deps_add (theme, theme->index_fname);
+    }
+
+    for (int i=0; i<theme->num_dirs; i++) {
+        string_t path_str = str_new (theme->dirs[i]);
+        theme_deps_add (theme, str_data(&path_str));
+
+        if (str_last(&path_str) != '/') {
+            str_cat_c (&path_str, "/");
+        }
+        uint32_t path_len = str_len (&path_str);
+
+        if (theme->dir_name != NULL) {
+            str_put_c (&path_str, path_len, GTK_ICON_CACHE_FNAME);
+            theme_deps_add (theme, str_data(&path_str));
+
+            for (int j=0; j<theme->num_sections; j++) {
+                str_put_c (&path_str, path_len, theme->sections[j].name);
+                theme_deps_add (theme, str_data(&path_str));
+            }
+        }
+
+        str_free (&path_str);
+    }
+}
+
+static inline
+int theme_cache_key_cmp (const char *dir_name_a, const char *index_fname_a,
+                         const char *dir_name_b, const char *index_fname_b)
+{
+    int cmp = strcmp (dir_name_a, dir_name_b);
+    return cmp != 0 ? cmp : strcmp (index_fname_a, index_fname_b);
+}
+
+// Binary search for the stored theme with dir_name and index_fname. Returns
+// NULL if there is none, or if the records are corrupt.
+struct theme_cache_theme_t* theme_cache_lookup (struct theme_cache_t *cache,
+                                                const char *dir_name, const char *index_fname)
+{
+    int lo = 0;
+    int hi = cache->header->num_themes - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo)/2;
+        struct theme_cache_theme_t *record = &cache->themes[mid];
+        char *record_dir_name = theme_cache_str (cache, record->dir_name);
+        char *record_index_fname = theme_cache_str (cache, record->index_fname);
+        if (record_dir_name == NULL || record_index_fname == NULL) {
+            return NULL;
+        }
+
+        int cmp = theme_cache_key_cmp (dir_name, index_fname, record_dir_name, record_index_fname);
+        if (cmp == 0) {
+            return record;
+        } else if (cmp < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Check that everything referenced by record is inside the file, so restoring
+// it can't read out of bounds or create invalid locations.
+bool theme_cache_record_is_valid (struct theme_cache_t *cache, struct theme_cache_theme_t *record)
+{
+    struct theme_cache_header_t *header = cache->header;
+    uint32_t num_words = (record->num_icons + 63)/64;
+    if (theme_cache_str (cache, record->name) == NULL ||
+        !theme_cache_range_ok (record->first_dep, record->num_deps, header->num_deps) ||
+        !theme_cache_range_ok (record->first_dir, record->num_dirs, header->num_strs) ||
+        !theme_cache_range_ok (record->first_inherit, record->num_inherits, header->num_strs) ||
+        !theme_cache_range_ok (record->first_section, record->num_sections, header->num_sections) ||
+        !theme_cache_range_ok (record->first_icon, record->num_icons, header->num_icons) ||
+        !theme_cache_range_ok (record->first_location, record->num_locations, header->num_locations) ||
+        !theme_cache_range_ok (record->first_facet, record->num_facets, header->num_facets) ||
+        !theme_cache_range_ok (record->first_facet_word, (uint64_t)record->num_facets*num_words,
+                               header->num_facet_words) ||
+        record->num_sections > UINT16_MAX + 1) {
+        return false;
+    }
+
+    for (uint32_t i=0; i<record->num_deps; i++) {
+        if (theme_cache_str (cache, cache->deps[record->first_dep + i].path) == NULL) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<record->num_dirs; i++) {
+        if (theme_cache_str (cache, cache->strs[record->first_dir + i]) == NULL) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<record->num_inherits; i++) {
+        if (theme_cache_str (cache, cache->strs[record->first_inherit + i]) == NULL) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<record->num_sections; i++) {
+        struct theme_cache_section_t *section = &cache->sections[record->first_section + i];
+        if (theme_cache_str (cache, section->name) == NULL ||
+            (section->type != THEME_CACHE_NONE && theme_cache_str (cache, section->type) == NULL) ||
+            (section->context != THEME_CACHE_NONE && theme_cache_str (cache, section->context) == NULL)) {
+            return false;
+        }
+    }
+
+    uint64_t num_locations = 0;
+    for (uint32_t i=0; i<record->num_icons; i++) {
+        struct theme_cache_icon_t *icon = &cache->icons[record->first_icon + i];
+        if (theme_cache_str (cache, icon->name) == NULL) {
+            return false;
+        }
+        num_locations += icon->num_locations;
+    }
+    if (num_locations != record->num_locations) {
+        return false;
+    }
+
+    // The theme of unthemed icons has no sections, its locations use section 0.
+    for (uint32_t i=0; i<record->num_locations; i++) {
+        struct icon_location_t *loc = &cache->locations[record->first_location + i];
+        if (loc->base_dir >= record->num_dirs || loc->ext >= NUM_EXTENSIONS ||
+            loc->section >= MAX (record->num_sections, 1)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<record->num_facets; i++) {
+        struct theme_cache_facet_t *facet = &cache->facets[record->first_facet + i];
+        if (facet->type >= NUM_ICON_FACET_TYPES || theme_cache_str (cache, facet->value) == NULL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// If there is a stored version of theme and none of its dependencies changed,
+// set all the tables of the theme from it and return true. Icon names are
+// interned into table. The theme must have its dir_name, index_fname and dirs
+// set, everything else comes from the file.
+bool theme_cache_restore (struct theme_cache_t *cache, struct icon_theme_t *theme,
+                          struct name_table_t *table)
+{
+    if (cache->map == NULL) {
+        return false;
+    }
+
+    struct theme_cache_theme_t *record =
+        theme_cache_lookup (cache,
+                            theme->dir_name != NULL ? theme->dir_name : "",
+                            theme->index_fname != NULL ? theme->index_fname : "");
+    if (record == NULL || !theme_cache_record_is_valid (cache, record) ||
+        record->num_dirs != theme->num_dirs) {
+        return false;
+    }
+
+    for (uint32_t i=0; i<record->num_dirs; i++) {
+        if (strcmp (theme_cache_str (cache, cache->strs[record->first_dir + i]), theme->dirs[i]) != 0) {
+            return false;
+        }
+    }
+
+    for (uint32_t i=0; i<record->num_deps; i++) {
+        struct theme_cache_dep_t *dep = &cache->deps[record->first_dep + i];
+
+        bool exists;
+        struct timespec mtime;
+        theme_dep_stat (theme_cache_str (cache, dep->path), &exists, &mtime);
+        if (exists != (dep->exists != 0) ||
+            mtime.tv_sec != dep->mtime_sec || mtime.tv_nsec != dep->mtime_nsec) {
+            return false;
+        }
+    }
+
+    // Intern names and build the set of the theme. Names of a theme are
+    // unique, if the set has less of them the record is corrupt.
+    mem_pool_t pool = {0};
+    uint32_t num_icons = record->num_icons;
+    struct theme_cache_icon_t *icons = &cache->icons[record->first_icon];
+    char **names = pom_push_array (&pool, MAX(num_icons, 1), char*);
+    uint32_t *ids = pom_push_array (&pool, MAX(num_icons, 1), uint32_t);
+    uint32_t max_id = 0;
+    for (uint32_t i=0; i<num_icons; i++) {
+        names[i] = theme_cache_str (cache, icons[i].name);
+    }
+    name_table_intern (table, names, num_icons, ids);
+
+    struct name_set_t icon_names;
+    for (uint32_t i=0; i<num_icons; i++) {
+        max_id = MAX (max_id, ids[i] + 1);
+    }
+    name_set_init (&theme->pool, &icon_names, max_id);
+    for (uint32_t i=0; i<num_icons; i++) {
+        name_set_add (&icon_names, ids[i]);
+    }
+    name_set_compute_rank (&icon_names);
+
+    if (icon_names.count != num_icons) {
+        mem_pool_destroy (&pool);
+        return false;
+    }
+
+    // NOTE: Arrays are allocated before any string so they are aligned.
+    uint32_t num_words = (num_icons + 63)/64;
+    theme->num_deps = record->num_deps;
+    theme->deps = pom_push_array (&theme->pool, MAX(record->num_deps, 1), struct theme_dep_t);
+    theme->num_inherits = record->num_inherits;
+    theme->inherits = pom_push_array (&theme->pool, MAX(record->num_inherits, 1), char*);
+    theme->num_sections = record->num_sections;
+    theme->sections = pom_push_array (&theme->pool, MAX(record->num_sections, 1), struct theme_section_t);
+    theme->sorted_icon_names = pom_push_array (&theme->pool, MAX(num_icons, 1), char*);
+    theme->icon_postings = pom_push_array (&theme->pool, MAX(num_icons, 1), struct icon_postings_t);
+    theme->num_facets = record->num_facets;
+    theme->facets = pom_push_array (&theme->pool, MAX(record->num_facets, 1), struct icon_facet_t);
+    for (uint32_t i=0; i<record->num_facets; i++) {
+        theme->facets[i].bits = pom_push_array (&theme->pool, MAX(num_words, 1), uint64_t);
+    }
+    theme->locations = pom_push_array (&theme->pool, MAX(record->num_locations, 1), struct icon_location_t);
+
+    theme->name = pom_strdup (&theme->pool, theme_cache_str (cache, record->name));
+
+    for (uint32_t i=0; i<record->num_deps; i++) {
+        struct theme_cache_dep_t *dep = &cache->deps[record->first_dep + i];
+        theme->deps[i].path = pom_strdup (&theme->pool, theme_cache_str (cache, dep->path));
+        theme->deps[i].exists = dep->exists != 0;
+        theme->deps[i].mtime.tv_sec = dep->mtime_sec;
+        theme->deps[i].mtime.tv_nsec = dep->mtime_nsec;
+    }
+
+    for (uint32_t i=0; i<record->num_inherits; i++) {
+        theme->inherits[i] =
+            pom_strdup (&theme->pool, theme_cache_str (cache, cache->strs[record->first_inherit + i]));
+    }
+
+    for (uint32_t i=0; i<record->num_sections; i++) {
+        struct theme_cache_section_t *stored = &cache->sections[record->first_section + i];
+        struct theme_section_t *section = &theme->sections[i];
+        section->name = pom_strdup (&theme->pool, theme_cache_str (cache, stored->name));
+        section->size = stored->size;
+        section->min_size = stored->min_size;
+        section->max_size = stored->max_size;
+        section->scale = stored->scale;
+        section->threshold = stored->threshold;
+        section->type = stored->type != THEME_CACHE_NONE ?
+            pom_strdup (&theme->pool, theme_cache_str (cache, stored->type)) : NULL;
+        section->context = stored->context != THEME_CACHE_NONE ?
+            pom_strdup (&theme->pool, theme_cache_str (cache, stored->context)) : NULL;
+        section->is_scalable = stored->is_scalable != 0;
+    }
+
+    // Names are stored sorted, and postings are indexed by the rank of each
+    // name in the set.
+    theme->icon_names = icon_names;
+    memcpy (theme->locations, &cache->locations[record->first_location],
+            record->num_locations*sizeof(struct icon_location_t));
+
+    struct icon_location_t *next_location = theme->locations;
+    for (uint32_t i=0; i<num_icons; i++) {
+        theme->sorted_icon_names[i] = name_table_get (table, ids[i]);
+
+        struct icon_postings_t *postings = &theme->icon_postings[name_set_rank (&theme->icon_names, ids[i])];
+        postings->num_locations = icons[i].num_locations;
+        postings->locations = next_location;
+        next_location += icons[i].num_locations;
+    }
+
+    for (uint32_t i=0; i<record->num_facets; i++) {
+        struct theme_cache_facet_t *stored = &cache->facets[record->first_facet + i];
+        struct icon_facet_t *facet = &theme->facets[i];
+        facet->type = stored->type;
+        facet->value = pom_strdup (&theme->pool, theme_cache_str (cache, stored->value));
+        memset (facet->bits, 0, MAX(num_words, 1)*sizeof(uint64_t));
+        memcpy (facet->bits, &cache->facet_words[record->first_facet_word + (size_t)i*num_words],
+                num_words*sizeof(uint64_t));
+    }
+
+    cache->num_restored++;
+    mem_pool_destroy (&pool);
+    return true;
+}
+
+struct theme_cache_writer_t {
+    cont_buff_t deps;
+    cont_buff_t facet_words;
+    cont_buff_t themes;
+    cont_buff_t sections;
+    cont_buff_t facets;
+    cont_buff_t strs;
+    cont_buff_t icons;
+    cont_buff_t locations;
+    cont_buff_t strings;
+
+    // Maps strings already in strings to their offset plus 1.
+    GHashTable *string_offsets;
+};
+
+#define theme_cache_writer_count(writer,buff,type) ((writer)->buff.used/sizeof(type))
+
+// Returns the offset of str in the strings section, adding it if it's not
+// there yet. str must stay valid until the writer is destroyed.
+uint32_t theme_cache_writer_str (struct theme_cache_writer_t *writer, const char *str)
+{
+    if (str == NULL) {
+        return THEME_CACHE_NONE;
+    }
+
+    uint32_t offset = GPOINTER_TO_UINT (g_hash_table_lookup (writer->string_offsets, str));
+    if (offset == 0) {
+        uint32_t str_size = strlen (str) + 1;
+        offset = writer->strings.used + 1;
+        memcpy (cont_buff_push (&writer->strings, str_size), str, str_size);
+        g_hash_table_insert (writer->string_offsets, (gpointer)str, GUINT_TO_POINTER (offset));
+    }
+    return offset - 1;
+}
+
+void theme_cache_writer_add_theme (struct theme_cache_writer_t *writer,
+                                   struct icon_theme_t *theme, struct name_table_t *table)
+{
+    struct theme_cache_theme_t record = {0};
+    record.dir_name = theme_cache_writer_str (writer, theme->dir_name != NULL ? theme->dir_name : "");
+    record.index_fname = theme_cache_writer_str (writer, theme->index_fname != NULL ? theme->index_fname : "");
+    record.name = theme_cache_writer_str (writer, theme->name);
+
+    record.first_dep = theme_cache_writer_count (writer, deps, struct theme_cache_dep_t);
+    record.num_deps = theme->num_deps;
+    for (uint32_t i=0; i<theme->num_deps; i++) {
+        struct theme_cache_dep_t *dep = cont_buff_push (&writer->deps, sizeof(struct theme_cache_dep_t));
+        dep->path = theme_cache_writer_str (writer, theme->deps[i].path);
+        dep->exists = theme->deps[i].exists;
+        dep->mtime_sec = theme->deps[i].mtime.tv_sec;
+        dep->mtime_nsec = theme->deps[i].mtime.tv_nsec;
+    }
+
+    record.first_dir = theme_cache_writer_count (writer, strs, uint32_t);
+    record.num_dirs = theme->num_dirs;
+    for (uint32_t i=0; i<theme->num_dirs; i++) {
+        uint32_t *str = cont_buff_push (&writer->strs, sizeof(uint32_t));
+        *str = theme_cache_writer_str (writer, theme->dirs[i]);
+    }
+
+    record.first_inherit = theme_cache_writer_count (writer, strs, uint32_t);
+    record.num_inherits = theme->num_inherits;
+    for (uint32_t i=0; i<theme->num_inherits; i++) {
+        uint32_t *str = cont_buff_push (&writer->strs, sizeof(uint32_t));
+        *str = theme_cache_writer_str (writer, theme->inherits[i]);
+    }
+
+    record.first_section = theme_cache_writer_count (writer, sections, struct theme_cache_section_t);
+    record.num_sections = theme->num_sections;
+    for (uint32_t i=0; i<theme->num_sections; i++) {
+        struct theme_section_t *section = &theme->sections[i];
+        struct theme_cache_section_t *stored =
+            cont_buff_push (&writer->sections, sizeof(struct theme_cache_section_t));
+        *stored = ZERO_INIT (struct theme_cache_section_t);
+        stored->name = theme_cache_writer_str (writer, section->name);
+        stored->type = theme_cache_writer_str (writer, section->type);
+        stored->context = theme_cache_writer_str (writer, section->context);
+        stored->size = section->size;
+        stored->min_size = section->min_size;
+        stored->max_size = section->max_size;
+        stored->scale = section->scale;
+        stored->threshold = section->threshold;
+        stored->is_scalable = section->is_scalable;
+    }
+
+    // Postings are indexed by rank, get the ones of each sorted name.
+    record.first_icon = theme_cache_writer_count (writer, icons, struct theme_cache_icon_t);
+    record.num_icons = theme->icon_names.count;
+    record.first_location = theme_cache_writer_count (writer, locations, struct icon_location_t);
+    for (uint32_t i=0; i<theme->icon_names.count; i++) {
+        uint32_t id;
+        name_table_lookup (table, theme->sorted_icon_names[i], &id);
+        struct icon_postings_t *postings = &theme->icon_postings[name_set_rank (&theme->icon_names, id)];
+
+        struct theme_cache_icon_t *icon = cont_buff_push (&writer->icons, sizeof(struct theme_cache_icon_t));
+        icon->name = theme_cache_writer_str (writer, theme->sorted_icon_names[i]);
+        icon->num_locations = postings->num_locations;
+
+        uint32_t locations_size = postings->num_locations*sizeof(struct icon_location_t);
+        memcpy (cont_buff_push (&writer->locations, locations_size), postings->locations, locations_size);
+        record.num_locations += postings->num_locations;
+    }
+
+    uint32_t num_words = (theme->icon_names.count + 63)/64;
+    record.first_facet = theme_cache_writer_count (writer, facets, struct theme_cache_facet_t);
+    record.num_facets = theme->num_facets;
+    record.first_facet_word = theme_cache_writer_count (writer, facet_words, uint64_t);
+    for (uint32_t i=0; i<theme->num_facets; i++) {
+        struct theme_cache_facet_t *facet = cont_buff_push (&writer->facets, sizeof(struct theme_cache_facet_t));
+        facet->type = theme->facets[i].type;
+        facet->value = theme_cache_writer_str (writer, theme->facets[i].value);
+
+        uint32_t words_size = num_words*sizeof(uint64_t);
+        memcpy (cont_buff_push (&writer->facet_words, words_size), theme->facets[i].bits, words_size);
+    }
+
+    struct theme_cache_theme_t *stored = cont_buff_push (&writer->themes, sizeof(struct theme_cache_theme_t));
+    *stored = record;
+}
+
+int theme_cache_theme_cmp (const void *a, const void *b)
+{
+    struct icon_theme_t *theme_a = *(struct icon_theme_t**)a;
+    struct icon_theme_t *theme_b = *(struct icon_theme_t**)b;
+    return theme_cache_key_cmp (theme_a->dir_name != NULL ? theme_a->dir_name : "",
+                                theme_a->index_fname != NULL ? theme_a->index_fname : "",
+                                theme_b->dir_name != NULL ? theme_b->dir_name : "",
+                                theme_b->index_fname != NULL ? theme_b->index_fname : "");
+}
+
+// Write all themes in the list starting at themes, linked by their found_next
+// field, into the cache file. Themes must be completely loaded. Nothing is
+// written if all of them were restored from the file and it has no others.
+void theme_cache_save (struct theme_cache_t *cache, struct icon_theme_t *themes,
+                       struct name_table_t *table)
+{
+    uint32_t num_themes = 0;
+    for (struct icon_theme_t *theme = themes; theme; theme = theme->found_next) {
+        num_themes++;
+    }
+
+    if (cache->map != NULL && cache->num_restored == num_themes &&
+        cache->header->num_themes == num_themes) {
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    struct icon_theme_t **sorted_themes = mem_pool_push_array (&pool, MAX(num_themes, 1), struct icon_theme_t*);
+    {
+        int i = 0;
+        for (struct icon_theme_t *theme = themes; theme; theme = theme->found_next) {
+            sorted_themes[i++] = theme;
+        }
+    }
+    qsort (sorted_themes, num_themes, sizeof(struct icon_theme_t*), theme_cache_theme_cmp);
+
+    struct theme_cache_writer_t writer = {0};
+    writer.string_offsets = g_hash_table_new (g_str_hash, g_str_equal);
+    for (uint32_t i=0; i<num_themes; i++) {
+        theme_cache_writer_add_theme (&writer, sorted_themes[i], table);
+    }
+
+    struct theme_cache_header_t header = {0};
+    memcpy (header.magic, THEME_CACHE_MAGIC, 4);
+    header.version = THEME_CACHE_VERSION;
+    header.num_themes = num_themes;
+    header.num_deps = theme_cache_writer_count (&writer, deps, struct theme_cache_dep_t);
+    header.num_facet_words = theme_cache_writer_count (&writer, facet_words, uint64_t);
+    header.num_sections = theme_cache_writer_count (&writer, sections, struct theme_cache_section_t);
+    header.num_facets = theme_cache_writer_count (&writer, facets, struct theme_cache_facet_t);
+    header.num_strs = theme_cache_writer_count (&writer, strs, uint32_t);
+    header.num_icons = theme_cache_writer_count (&writer, icons, struct theme_cache_icon_t);
+    header.num_locations = theme_cache_writer_count (&writer, locations, struct icon_location_t);
+    header.strings_size = writer.strings.used;
+
+    cont_buff_t *sections[] = {&writer.deps, &writer.facet_words, &writer.themes, &writer.sections,
+                               &writer.facets, &writer.strs, &writer.icons, &writer.locations,
+                               &writer.strings};
+
+    size_t file_size = sizeof(struct theme_cache_header_t);
+    for (int i=0; i<ARRAY_SIZE(sections); i++) {
+        file_size += sections[i]->used;
+    }
+
+    uint8_t *data = pom_push_size (NULL, file_size);
+    uint8_t *pos = data;
+    memcpy (pos, &header, sizeof(struct theme_cache_header_t));
+    pos += sizeof(struct theme_cache_header_t);
+    for (int i=0; i<ARRAY_SIZE(sections); i++) {
+        if (sections[i]->used > 0) {
+            memcpy (pos, sections[i]->data, sections[i]->used);
+            pos += sections[i]->used;
+        }
+        cont_buff_destroy (sections[i]);
+    }
+    g_hash_table_destroy (writer.string_offsets);
+
+    // Same as with the directory cache, write into a temporary file and then
+    // rename it.
+    char *tmp_fname = pprintf (&pool, "%s.tmp", cache->fname);
+    if (ensure_path_exists (cache->fname) && !full_file_write (data, file_size, tmp_fname)) {
+        if (rename (tmp_fname, cache->fname) != 0) {
+            printf ("Error writing theme cache %s: %s\n", cache->fname, strerror(errno));
+            unlink (tmp_fname);
+        }
+    }
+
+    free (data);
+    mem_pool_destroy (&pool);
+}